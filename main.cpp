@@ -3,10 +3,43 @@
 #include <string>
 #include <algorithm>
 #include <utility>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <boost/lambda/lambda.hpp>
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/utility/string_view.hpp>
 
 #include <fmt/format.h>
 
@@ -14,34 +47,224 @@ namespace asio = boost::asio;
 
 using namespace std::placeholders;
 
+namespace fmt {
+template <>
+struct formatter<boost::string_view> : formatter<string_view> {
+    template <typename FormatContext>
+    auto format(boost::string_view value, FormatContext &ctx) -> decltype(ctx.out()) {
+        return formatter<string_view>::format(string_view(value.data(), value.size()), ctx);
+    }
+};
+}
+
+inline char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+// Case-insensitive comparison for header names and tokens, which are ASCII.
+inline bool ascii_iequals(boost::string_view a, boost::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (ascii_lower(a[i]) != ascii_lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline boost::string_view trim_ows(boost::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+// Log levels for diagnostics; results and errors meant for the user are
+// printed directly. Messages below MYCURL_LOG_LEVEL are compiled out: their
+// arguments are still checked against the format but never evaluated. The
+// rest are formatted by the caller and written by AsyncLog.
+#define MYCURL_LOG_DEBUG 0
+#define MYCURL_LOG_INFO 1
+#define MYCURL_LOG_WARN 2
+#define MYCURL_LOG_OFF 3
+
+#ifndef MYCURL_LOG_LEVEL
+#define MYCURL_LOG_LEVEL MYCURL_LOG_DEBUG
+#endif
+
+#define MYCURL_LOG_ENABLED(level) (MYCURL_LOG_##level >= MYCURL_LOG_LEVEL)
+#define MYCURL_LOG_DISCARD(...) do { (void) sizeof(fmt::format(__VA_ARGS__)); } while (0)
+
+#if MYCURL_LOG_ENABLED(DEBUG)
+#define LOG_DEBUG(...) AsyncLog::Instance().Write(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) MYCURL_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if MYCURL_LOG_ENABLED(INFO)
+#define LOG_INFO(...) AsyncLog::Instance().Write(__VA_ARGS__)
+#else
+#define LOG_INFO(...) MYCURL_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if MYCURL_LOG_ENABLED(WARN)
+#define LOG_WARN(...) AsyncLog::Instance().Write(__VA_ARGS__)
+#define LOG_FLUSH() AsyncLog::Instance().Flush()
+#else
+#define LOG_WARN(...) MYCURL_LOG_DISCARD(__VA_ARGS__)
+#define LOG_FLUSH() do {} while (0)
+#endif
+
+// Writes log lines to stderr from a background thread. Producers push into a
+// bounded lock-free ring (Vyukov's MPMC queue: each slot's sequence number
+// says whether it is free for the producer or filled for the consumer) and
+// never block; lines that find the ring full are counted and dropped.
+class AsyncLog {
+public:
+    static AsyncLog &Instance() {
+        static AsyncLog log;
+        return log;
+    }
+
+    template <typename... Args>
+    void Write(fmt::format_string<Args...> format, Args &&... args) {
+        push(fmt::format(format, std::forward<Args>(args)...));
+    }
+
+    // Waits until every line pushed so far has been written.
+    void Flush() {
+        while (written_.load(std::memory_order_acquire) != head_.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        std::fflush(stderr);
+    }
+
+    ~AsyncLog() {
+        stop_.store(true, std::memory_order_release);
+        writer_.join();
+
+        size_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != 0) {
+            fmt::print(stderr, "{} log line(s) dropped\n", dropped);
+        }
+    }
+
+private:
+    static const size_t kCapacity = 4096;
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        std::string text;
+    };
+
+    std::unique_ptr<Slot[]> slots_{new Slot[kCapacity]};
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> written_{0};
+    std::atomic<size_t> dropped_{0};
+    std::atomic<bool> stop_{false};
+    size_t tail_ = 0;
+    std::thread writer_;
+
+    AsyncLog() {
+        for (size_t i = 0; i < kCapacity; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        writer_ = std::thread(&AsyncLog::run, this);
+    }
+
+    void push(std::string text) {
+        size_t position = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot &slot = slots_[position % kCapacity];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == position) {
+                if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    slot.text = std::move(text);
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return;
+                }
+            } else if (sequence < position) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                position = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Only the writer thread takes lines out, so the tail needs no atomics.
+    bool pop(std::string &text) {
+        Slot &slot = slots_[tail_ % kCapacity];
+        if (slot.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+            return false;
+        }
+        text = std::move(slot.text);
+        slot.text.clear();
+        slot.sequence.store(tail_ + kCapacity, std::memory_order_release);
+        ++tail_;
+        return true;
+    }
+
+    void run() {
+        std::string text;
+        for (;;) {
+            bool stopping = stop_.load(std::memory_order_acquire);
+            size_t lines = 0;
+            while (pop(text)) {
+                std::fwrite(text.data(), 1, text.size(), stderr);
+                ++lines;
+            }
+            if (lines != 0) {
+                std::fflush(stderr);
+                written_.fetch_add(lines, std::memory_order_release);
+                continue;
+            }
+            if (stopping) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+};
+
 class Url {
 public:
     Url() = delete;
 
     explicit Url(const std::string& url) {
-        int protocolEndPos = 0;
-        int hostStartPos = 0;
-        int pathStartPos = url.size();
-
-        for (int i = 0; i < url.size(); ++i) {
-            switch (url[i]) {
-                case ':':
-                    protocolEndPos = i;
-                    hostStartPos = i += 3;
-                    break;
-                case '/':
-                    pathStartPos = i;
-                    i = url.size();
-                    break;
-            }
+        size_t hostStartPos = 0;
+
+        size_t protocolEndPos = url.find("://");
+        if (protocolEndPos != std::string::npos) {
+            protocol_ = boost::algorithm::to_lower_copy(url.substr(0, protocolEndPos));
+            hostStartPos = protocolEndPos + 3;
         }
 
-        if (protocolEndPos != 0) {
-            protocol_ = url.substr(0, protocolEndPos);
+        size_t pathStartPos = url.find('/', hostStartPos);
+        if (pathStartPos == std::string::npos) {
+            pathStartPos = url.size();
         }
 
         host_ = url.substr(hostStartPos, pathStartPos - hostStartPos);
 
+        // An IPv6 literal is bracketed, as its colons would read as a port.
+        size_t portStartPos = host_.rfind(':');
+        size_t literalEndPos = host_.find(']');
+        if (!host_.empty() && host_[0] == '[' && literalEndPos != std::string::npos) {
+            if (literalEndPos + 1 < host_.size() && host_[literalEndPos + 1] == ':') {
+                port_ = host_.substr(literalEndPos + 2);
+            }
+            host_ = host_.substr(1, literalEndPos - 1);
+        } else if (portStartPos != std::string::npos) {
+            port_ = host_.substr(portStartPos + 1);
+            host_.erase(portStartPos);
+        }
+
         if (pathStartPos != url.size()) {
             path_ = url.substr(pathStartPos);
         }
@@ -54,7 +277,7 @@ public:
         : protocol_(std::move(protocol)), host_(std::move(host)), path_(std::move(path)) {}
 
     std::string GetFullUrl() const {
-        return fmt::format("{}://{}{}", protocol_, host_, path_);
+        return fmt::format("{}://{}{}", protocol_, FormatAuthority(host_, GetPort()), path_);
     }
     std::string GetProtocol() const {
         return protocol_;
@@ -62,228 +285,6586 @@ public:
     std::string GetHost() const {
         return host_;
     }
+    // Explicit port if present, otherwise the protocol name as a resolver service.
+    std::string GetPort() const {
+        return port_.empty() ? protocol_ : port_;
+    }
     std::string GetPath() const {
         return path_;
     }
+    // The same URL with another path, for requests that share a connection.
+    Url WithPath(std::string path) const {
+        Url url(*this);
+        url.path_ = std::move(path);
+        return url;
+    }
+
+    // host as it goes in a URL or a Host header, bracketed if it is an IPv6
+    // literal, followed by port if that is a number rather than the
+    // protocol name GetPort() falls back to.
+    static std::string FormatAuthority(const std::string &host, const std::string &port) {
+        std::string authority = host.find(':') != std::string::npos ? "[" + host + "]" : host;
+        if (!port.empty() && std::all_of(port.begin(), port.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            authority += ":" + port;
+        }
+        return authority;
+    }
 private:
     std::string protocol_ = "http";
     std::string host_;
+    std::string port_;
     std::string path_ = "/";
 };
 
-class HttpClient {
-    std::string method_;
-    std::string body_;
+// Caches resolver results per (host, port) for a fixed TTL, failures for a
+// shorter one, and collapses concurrent lookups of the same name into a
+// single query. getaddrinfo does not report record TTLs, so the TTL is
+// configured rather than taken from DNS.
+class DnsCache {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Endpoints = std::shared_ptr<const std::vector<asio::ip::tcp::endpoint>>;
+    using Handler = std::function<void(const boost::system::error_code &, const Endpoints &)>;
 
-    const std::string host_;
-    const std::string path_;
+    DnsCache(asio::ip::tcp::resolver &resolver, Clock::duration ttl, Clock::duration negativeTtl)
+            : resolver_(resolver), ttl_(ttl), negativeTtl_(negativeTtl) {}
 
-    asio::ip::tcp::resolver &resolver_;
-    asio::ip::tcp::socket sock_;
+    // Like resolver::async_resolve, the handler is never called from inside Resolve().
+    void Resolve(const std::string &host, const std::string &port, Handler handler) {
+        Clock::time_point now = Clock::now();
+        if (now >= nextSweep_) {
+            sweep(now);
+        }
 
-    std::string request_;
-    asio::streambuf response_;
+        std::string key = host + ':' + port;
+        Entry &entry = entries_[key];
 
-public:
-    HttpClient(asio::io_service &io_service, asio::ip::tcp::resolver &resolver,
-               std::string host, std::string path, std::string body, std::string method)
-            : host_(std::move(host)), path_(std::move(path)), resolver_(resolver), sock_(io_service),
-              method_(std::move(method)), body_(std::move(body)) {
-        requestFields_.insert({
-            {"Host", host_},
-            {"User-Agent", "mycurl/1.0"}
-        });
-    }
+        if (entry.resolving) {
+            entry.waiters.push_back(std::move(handler));
+            return;
+        }
+
+        if (now < entry.expires) {
+            ++hits_;
+            boost::system::error_code ec = entry.ec;
+            Endpoints endpoints = entry.endpoints;
+            asio::post(resolver_.get_executor(), [handler, ec, endpoints]() { handler(ec, endpoints); });
+            return;
+        }
+
+        ++misses_;
+        entry.resolving = true;
+        entry.waiters.push_back(std::move(handler));
 
-    void Start() {
         resolver_.async_resolve(
-                asio::ip::tcp::resolver::query(host_, "http"),
-                [this](const boost::system::error_code &ec,
-                       const asio::ip::tcp::resolver::iterator &it) {
-                    if (ec) {
-                        fmt::print(stderr, "Error resolving {}: {}\n", host_, ec.message());
-                        return;
+                asio::ip::tcp::resolver::query(host, port),
+                [this, key](const boost::system::error_code &ec, asio::ip::tcp::resolver::iterator it) {
+                    std::shared_ptr<std::vector<asio::ip::tcp::endpoint>> endpoints(
+                            new std::vector<asio::ip::tcp::endpoint>());
+                    for (; !ec && it != asio::ip::tcp::resolver::iterator(); ++it) {
+                        endpoints->push_back(it->endpoint());
+                    }
+
+                    Entry &entry = entries_[key];
+                    entry.resolving = false;
+                    entry.ec = ec;
+                    if (!ec && endpoints->empty()) {
+                        entry.ec = asio::error::host_not_found;
                     }
+                    entry.endpoints = endpoints;
+                    entry.expires = Clock::now() + (entry.ec ? negativeTtl_ : ttl_);
 
-                    fmt::print("{}: resolved to {}:{}\n", host_,
-                               it->endpoint().address().to_string(), it->endpoint().port());
-                    do_connect(it->endpoint());
+                    std::vector<Handler> waiters;
+                    waiters.swap(entry.waiters);
+                    for (const auto &waiter : waiters) {
+                        waiter(entry.ec, entry.endpoints);
+                    }
                 });
     }
 
+    size_t Hits() const {
+        return hits_;
+    }
+
+    size_t Misses() const {
+        return misses_;
+    }
+
 private:
-    std::map<std::string, std::string> requestFields_;
+    struct Entry {
+        bool resolving = false;
+        Clock::time_point expires;
+        boost::system::error_code ec;
+        Endpoints endpoints;
+        std::vector<Handler> waiters;
+    };
 
-    void do_connect(const asio::ip::tcp::endpoint &dest) {
-        sock_.async_connect(
-                dest, [this](const boost::system::error_code &ec) {
-                    if (ec) {
-                        fmt::print(stderr, "Error connecting to {}: {}\n", host_, ec.message());
-                        return;
-                    }
+    asio::ip::tcp::resolver &resolver_;
+    Clock::duration ttl_;
+    Clock::duration negativeTtl_;
 
-                    fmt::print("{}: connected to {}:{}\n", host_,
-                               sock_.remote_endpoint().address().to_string(),
-                               sock_.remote_endpoint().port());
+    std::map<std::string, Entry> entries_;
+    Clock::time_point nextSweep_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
 
-                    do_send_http();
-                }
-        );
+    // Drops expired entries that no lookup is waiting on, at most once per
+    // TTL, so names that are never asked for again do not pile up.
+    void sweep(Clock::time_point now) {
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (!it->second.resolving && it->second.expires <= now) {
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        nextSweep_ = now + ttl_;
     }
+};
 
-    void do_send_http() {
-        if (method_ == "POST") {
-            requestFields_.emplace("Content-Length", std::to_string(body_.length()));
-        }
+// Keeps idle keep-alive sockets per (host, port) so consecutive requests
+// to the same server skip the resolve and TCP handshake.
+//
+// The pool also counts requests in flight per endpoint and decides which of
+// a name's addresses a new connection should try first, so load spreads over
+// every backend the name resolves to.
+class ConnectionPool {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum Balancing {
+        RoundRobin,
+        // Power of two choices: the less loaded of two random endpoints.
+        TwoChoices,
+    };
 
-        request_ = fmt::format("{} {} HTTP/1.1\r\n", method_, path_);
+    ConnectionPool(size_t maxIdle, size_t maxPerHost, Clock::duration idleTimeout, Balancing balancing = RoundRobin)
+            : maxIdle_(maxIdle), maxPerHost_(maxPerHost), idleTimeout_(idleTimeout), balancing_(balancing),
+              random_(std::random_device()()) {}
 
-        for (const auto& field : requestFields_) {
-            request_ += fmt::format("{}: {}\r\n", field.first, field.second);
+    // Order in which a new connection should try the endpoints: the one the
+    // balancer picked first, whatever its family, then the others alternating
+    // between IPv6 and IPv4, starting with the family the pick is not in.
+    std::vector<asio::ip::tcp::endpoint> Order(const std::string &host, const std::string &port,
+                                               const std::vector<asio::ip::tcp::endpoint> &endpoints) {
+        std::vector<asio::ip::tcp::endpoint> ordered(endpoints);
+        if (ordered.size() < 2) {
+            return ordered;
         }
-        request_ += "\r\n";
 
-        if (method_ == "POST") {
-            request_ += fmt::format("{}\r\n\r\n", body_);
+        size_t first = 0;
+        if (balancing_ == RoundRobin) {
+            first = nextEndpoint_[key(host, port)]++ % ordered.size();
+        } else {
+            std::uniform_int_distribution<size_t> pick(0, ordered.size() - 1);
+            size_t a = pick(random_);
+            size_t b = pick(random_);
+            first = Outstanding(ordered[b]) < Outstanding(ordered[a]) ? b : a;
         }
 
-        asio::async_write(
-                sock_, asio::buffer(request_),
-                [this](const boost::system::error_code &ec, std::size_t size) {
-                    if (ec) {
-                        fmt::print(stderr, "Error sending {}: {}: {}\n", method_, ec.category().name(), ec.value());
-                        return;
-                    }
+        std::rotate(ordered.begin(), ordered.begin() + first, ordered.end());
+        std::vector<asio::ip::tcp::endpoint> rest =
+                interleave_families(ordered.begin() + 1, ordered.end(), !ordered.front().address().is_v6());
+        std::copy(rest.begin(), rest.end(), ordered.begin() + 1);
+        return ordered;
+    }
 
-                    fmt::print("{}: sent {} bytes\n", host_, size);
+    // How long a new connection waits on one address before also racing the
+    // next (RFC 8305 Connection Attempt Delay).
+    Clock::duration AttemptDelay() const {
+        return attemptDelay_;
+    }
 
-                    do_recv_http_header();
-                }
-        );
+    void SetAttemptDelay(Clock::duration delay) {
+        attemptDelay_ = delay;
     }
 
-    void do_recv_http_header() {
-        asio::async_read_until(
-                sock_, response_, "\r\n\r\n",
-                [this](const boost::system::error_code &ec, std::size_t size) {
-                    if (ec) {
-                        fmt::print(stderr, "Error receiving header: {}: {}\n", ec.category().name(), ec.value());
-                        return;
-                    }
+    void BeginRequest(const asio::ip::tcp::endpoint &endpoint) {
+        ++outstanding_[endpoint];
+    }
+
+    void EndRequest(const asio::ip::tcp::endpoint &endpoint) {
+        auto it = outstanding_.find(endpoint);
+        if (it != outstanding_.end() && --it->second == 0) {
+            outstanding_.erase(it);
+        }
+    }
 
-                    fmt::format("{}: received {}, streambuf {}\n", host_, size, response_.size());
+    size_t Outstanding(const asio::ip::tcp::endpoint &endpoint) const {
+        auto it = outstanding_.find(endpoint);
+        return it == outstanding_.end() ? 0 : it->second;
+    }
 
-                    std::string header(
-                            asio::buffers_begin(response_.data()),
-                            asio::buffers_begin(response_.data()) + size);
-                    response_.consume(size);
+    // Moves a live idle connection into sock. Returns false if there is none.
+    bool Acquire(const std::string &host, const std::string &port, asio::ip::tcp::socket &sock) {
+        auto it = idle_.find(key(host, port));
+        if (it == idle_.end()) {
+            return false;
+        }
 
-                    fmt::print("{}: header length {}\n{}\n", host_, header.size(), header);
+        auto &conns = it->second;
+        Clock::time_point now = Clock::now();
+        bool found = false;
 
-                    size_t pos = header.find("Content-Length: ");
-                    if (pos != std::string::npos) {
-                        size_t len = std::strtoul(
-                                header.c_str() + pos + sizeof("Content-Length: ") - 1,
-                                nullptr, 10);
-                        do_receive_http_body(len - response_.size());
-                        return;
-                    }
+        // Most recently returned connections are at the back and the least likely to be stale.
+        while (!conns.empty() && !found) {
+            IdleConnection conn = std::move(conns.back());
+            conns.pop_back();
+            --idleCount_;
 
-                    pos = header.find("Transfer-Encoding: chunked");
-                    if (pos != std::string::npos) {
-                        do_receive_http_chunked_body();
-                        return;
-                    }
+            if (now - conn.since < idleTimeout_ && is_alive(conn.sock)) {
+                sock = std::move(conn.sock);
+                found = true;
+            }
+        }
 
-                    fmt::print(stderr, "Unknown body length");
-                });
+        if (conns.empty()) {
+            idle_.erase(it);
+        }
+
+        return found;
+    }
+
+    // Takes back a connection whose response has been fully read.
+    void Release(const std::string &host, const std::string &port, asio::ip::tcp::socket sock) {
+        if (maxIdle_ == 0 || maxPerHost_ == 0 || !sock.is_open()) {
+            return;
+        }
+
+        Clock::time_point now = Clock::now();
+        expire(now);
+
+        auto &conns = idle_[key(host, port)];
+        if (conns.size() >= maxPerHost_) {
+            conns.pop_front();
+            --idleCount_;
+        } else if (idleCount_ >= maxIdle_) {
+            evict_oldest();
+        }
+
+        conns.push_back(IdleConnection{std::move(sock), now});
+        ++idleCount_;
     }
 
-    void do_receive_http_body(size_t len) {
-        asio::async_read(
-                sock_, response_, asio::transfer_exactly(len),
-                std::bind(&HttpClient::handle_http_body, this, _1, _2));
+    size_t Size() const {
+        return idleCount_;
     }
 
-    void do_receive_http_chunked_body() {
-        asio::async_read_until(
-                sock_, response_, "\r\n\r\n",
-                std::bind(&HttpClient::handle_http_body, this, _1, _2));
+private:
+    struct IdleConnection {
+        asio::ip::tcp::socket sock;
+        Clock::time_point since;
+    };
+
+    size_t maxIdle_;
+    size_t maxPerHost_;
+    Clock::duration idleTimeout_;
+
+    Balancing balancing_;
+    Clock::duration attemptDelay_ = std::chrono::milliseconds(250);
+    std::mt19937 random_;
+    std::map<std::string, size_t> nextEndpoint_;
+    std::map<asio::ip::tcp::endpoint, size_t> outstanding_;
+
+    size_t idleCount_ = 0;
+    std::map<std::string, std::deque<IdleConnection>> idle_;
+
+    static std::string key(const std::string &host, const std::string &port) {
+        return host + ':' + port;
     }
 
-    void handle_http_body(const boost::system::error_code &ec,
-                          std::size_t size) {
-        if (ec) {
-            fmt::print(stderr, "Error receiving body: {}: {}\n", ec.category().name(), ec.value());
-            return;
+    // RFC 8305 section 4: alternate address families, keeping the order
+    // within each family.
+    static std::vector<asio::ip::tcp::endpoint> interleave_families(
+            std::vector<asio::ip::tcp::endpoint>::const_iterator begin,
+            std::vector<asio::ip::tcp::endpoint>::const_iterator end, bool v6First) {
+        std::vector<asio::ip::tcp::endpoint> preferred;
+        std::vector<asio::ip::tcp::endpoint> other;
+        for (auto it = begin; it != end; ++it) {
+            (it->address().is_v6() == v6First ? preferred : other).push_back(*it);
+        }
+
+        std::vector<asio::ip::tcp::endpoint> interleaved;
+        interleaved.reserve(preferred.size() + other.size());
+        for (size_t i = 0; i < std::max(preferred.size(), other.size()); ++i) {
+            if (i < preferred.size()) {
+                interleaved.push_back(preferred[i]);
+            }
+            if (i < other.size()) {
+                interleaved.push_back(other[i]);
+            }
         }
+        return interleaved;
+    }
 
-        fmt::format("{}: received {}, streambuf {}\n", host_, size, response_.size());
+    // An idle HTTP connection has nothing to read, so readable data or EOF means
+    // the server has closed it or sent something we cannot use.
+    static bool is_alive(asio::ip::tcp::socket &sock) {
+        char c;
+        ssize_t n = ::recv(sock.native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
 
-        const auto &data = response_.data();
-        std::string body(asio::buffers_begin(data), asio::buffers_end(data));
-        response_.consume(size);
+    void expire(Clock::time_point now) {
+        for (auto it = idle_.begin(); it != idle_.end();) {
+            auto &conns = it->second;
+            while (!conns.empty() && now - conns.front().since >= idleTimeout_) {
+                conns.pop_front();
+                --idleCount_;
+            }
+            it = conns.empty() ? idle_.erase(it) : std::next(it);
+        }
+    }
+
+    void evict_oldest() {
+        auto oldest = idle_.end();
+        for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+            if (!it->second.empty() &&
+                (oldest == idle_.end() || it->second.front().since < oldest->second.front().since)) {
+                oldest = it;
+            }
+        }
 
-        fmt::print("{}: body length {}\n{}", host_, body.size(), body);
+        if (oldest != idle_.end()) {
+            oldest->second.pop_front();
+            --idleCount_;
+            if (oldest->second.empty()) {
+                idle_.erase(oldest);
+            }
+        }
     }
 };
 
-void docs(std::string programName) {
-    if (programName.empty()) {
-        programName = "mycurl";
+// Header names the client acts on or commonly sees, identified without
+// comparing strings. Names are matched case-insensitively; HTTP/2 pseudo
+// headers are included as they appear in HPACK blocks.
+enum class KnownHeader : uint8_t {
+    Unknown,
+    Status,
+    Accept,
+    AcceptEncoding,
+    AcceptRanges,
+    Age,
+    CacheControl,
+    Connection,
+    ContentDisposition,
+    ContentEncoding,
+    ContentLength,
+    ContentRange,
+    ContentType,
+    Date,
+    ETag,
+    Expires,
+    Host,
+    KeepAlive,
+    LastModified,
+    Location,
+    Range,
+    RetryAfter,
+    Server,
+    SetCookie,
+    Trailer,
+    TransferEncoding,
+    Upgrade,
+    UserAgent,
+    Vary,
+};
+
+// Lowercase names in KnownHeader order, after the empty Unknown.
+constexpr const char *kKnownHeaderNames[] = {
+    "",
+    ":status",
+    "accept",
+    "accept-encoding",
+    "accept-ranges",
+    "age",
+    "cache-control",
+    "connection",
+    "content-disposition",
+    "content-encoding",
+    "content-length",
+    "content-range",
+    "content-type",
+    "date",
+    "etag",
+    "expires",
+    "host",
+    "keep-alive",
+    "last-modified",
+    "location",
+    "range",
+    "retry-after",
+    "server",
+    "set-cookie",
+    "trailer",
+    "transfer-encoding",
+    "upgrade",
+    "user-agent",
+    "vary",
+};
+
+constexpr size_t kKnownHeaderCount = sizeof(kKnownHeaderNames) / sizeof(kKnownHeaderNames[0]);
+
+// FNV-1a over the lowercased name; HeaderFields stores this for every field.
+constexpr uint32_t kNameHashBasis = 2166136261u;
+constexpr uint32_t kNameHashPrime = 16777619u;
+
+inline uint32_t header_name_hash(boost::string_view name) {
+    uint32_t hash = kNameHashBasis;
+    for (char c : name) {
+        hash = (hash ^ static_cast<uint8_t>(ascii_lower(c))) * kNameHashPrime;
     }
+    return hash;
+}
 
-    fmt::print("Usage: {} [options...] <url>\n"
-                " -d <data>   HTTP POST data\n"
-                " -m <method> HTTP method (default: GET)\n",
-                programName);
+// Perfect hash of the known names into kKnownHeaderSlots slots, generated at
+// compile time. A name's slot comes from its FNV hash mixed with a seed; the
+// seed is the first one, counting up from 1, that gives every known name a
+// slot of its own. Classifying a name then takes one table probe and one
+// comparison with the name in that slot. C++11 constexpr functions are a
+// single return statement, hence the recursion.
+constexpr unsigned kKnownHeaderSlotBits = 8;
+constexpr size_t kKnownHeaderSlots = size_t(1) << kKnownHeaderSlotBits;
+
+constexpr uint32_t constexpr_name_hash(const char *name, uint32_t hash = kNameHashBasis) {
+    return *name == 0 ? hash : constexpr_name_hash(name + 1, (hash ^ static_cast<uint8_t>(*name)) * kNameHashPrime);
 }
 
-int main(int argc, char *argv[]) {
-    std::string method = "GET";
-    std::string body;
+constexpr size_t constexpr_length(const char *name) {
+    return *name == 0 ? 0 : 1 + constexpr_length(name + 1);
+}
 
-    if (argc < 2) {
-        docs(argv[0]);
-        return 0;
+constexpr size_t known_header_slot(uint32_t hash, uint32_t seed) {
+    return static_cast<uint32_t>((hash ^ seed) * 2654435761u) >> (32 - kKnownHeaderSlotBits);
+}
+
+constexpr size_t known_name_slot(size_t id, uint32_t seed) {
+    return known_header_slot(constexpr_name_hash(kKnownHeaderNames[id]), seed);
+}
+
+constexpr bool slot_unique(uint32_t seed, size_t id, size_t other) {
+    return other == kKnownHeaderCount ||
+           (known_name_slot(id, seed) != known_name_slot(other, seed) && slot_unique(seed, id, other + 1));
+}
+
+constexpr bool seed_is_perfect(uint32_t seed, size_t id = 1) {
+    return id == kKnownHeaderCount || (slot_unique(seed, id, id + 1) && seed_is_perfect(seed, id + 1));
+}
+
+constexpr uint32_t find_perfect_seed(uint32_t seed = 1) {
+    return seed_is_perfect(seed) ? seed : find_perfect_seed(seed + 1);
+}
+
+constexpr uint32_t kKnownHeaderSeed = find_perfect_seed();
+
+constexpr uint8_t known_header_in_slot(size_t slot, size_t id = 1) {
+    return id == kKnownHeaderCount ? 0
+           : known_name_slot(id, kKnownHeaderSeed) == slot ? static_cast<uint8_t>(id)
+           : known_header_in_slot(slot, id + 1);
+}
+
+template <size_t... I>
+struct IndexSequence {};
+
+template <size_t N, size_t... I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct MakeIndexSequence<0, I...> {
+    using Type = IndexSequence<I...>;
+};
+
+struct KnownHeaderTable {
+    uint8_t ids[kKnownHeaderSlots];
+    uint8_t lengths[kKnownHeaderCount];
+};
+
+template <size_t... Slot, size_t... Id>
+constexpr KnownHeaderTable make_known_header_table(IndexSequence<Slot...>, IndexSequence<Id...>) {
+    return KnownHeaderTable{{known_header_in_slot(Slot)...},
+                            {static_cast<uint8_t>(constexpr_length(kKnownHeaderNames[Id]))...}};
+}
+
+constexpr KnownHeaderTable kKnownHeaderTable = make_known_header_table(
+        MakeIndexSequence<kKnownHeaderSlots>::Type(), MakeIndexSequence<kKnownHeaderCount>::Type());
+
+static_assert(kKnownHeaderCount == static_cast<size_t>(KnownHeader::Vary) + 1,
+              "kKnownHeaderNames must list every KnownHeader");
+
+// Classifies a name given its header_name_hash().
+inline KnownHeader classify_header(boost::string_view name, uint32_t hash) {
+    uint8_t id = kKnownHeaderTable.ids[known_header_slot(hash, kKnownHeaderSeed)];
+    if (id == 0 || name.size() != kKnownHeaderTable.lengths[id] ||
+        !ascii_iequals(name, boost::string_view(kKnownHeaderNames[id], name.size()))) {
+        return KnownHeader::Unknown;
     }
+    return static_cast<KnownHeader>(id);
+}
 
-    int c;
-    while ((c = getopt(argc, argv, "m:d:")) != -1) {
-        switch (c) {
-            case 'm':
-                method = optarg;
-                boost::to_upper(method);
-                break;
-            case 'd':
-                body = optarg;
-                break;
-            default:
-                docs(argv[0]);
-                return 0;
+// Growable array of trivially copyable values whose first N elements live
+// inline, so small contents need no allocation.
+template <typename T, size_t N>
+class InlineArray {
+public:
+    InlineArray() = default;
+
+    InlineArray(const InlineArray &other) {
+        append(other.data(), other.size_);
+    }
+
+    InlineArray &operator=(const InlineArray &other) {
+        if (this != &other) {
+            size_ = 0;
+            append(other.data(), other.size_);
         }
+        return *this;
     }
 
-    asio::io_service io_service;
-    asio::ip::tcp::resolver resolver(io_service);
-    std::vector <std::unique_ptr<HttpClient>> clients;
+    T *data() {
+        return heap_ ? heap_.get() : inline_.data();
+    }
 
-    std::string fullUrl = argv[argc - 1];
-    Url url(fullUrl);
+    const T *data() const {
+        return heap_ ? heap_.get() : inline_.data();
+    }
 
-    std::string host = url.GetHost();
-    std::string path = url.GetPath();
+    size_t size() const {
+        return size_;
+    }
 
-    fmt::print("{}: fetching {}\n", host, path);
+    void clear() {
+        size_ = 0;
+    }
 
-    std::unique_ptr <HttpClient> client(
-            new HttpClient(
-                    io_service, resolver, host, path, body, method));
-    client->Start();
+    void append(const T *values, size_t count) {
+        reserve(size_ + count);
+        std::copy(values, values + count, data() + size_);
+        size_ += count;
+    }
 
-    clients.push_back(std::move(client));
+    void erase(size_t offset, size_t count) {
+        T *base = data();
+        std::copy(base + offset + count, base + size_, base + offset);
+        size_ -= count;
+    }
 
-    io_service.run();
+private:
+    std::array<T, N> inline_;
+    std::unique_ptr<T[]> heap_;
+    size_t size_ = 0;
+    size_t capacity_ = N;
+
+    void reserve(size_t size) {
+        if (size <= capacity_) {
+            return;
+        }
+        size_t capacity = std::max(size, capacity_ * 2);
+        std::unique_ptr<T[]> heap(new T[capacity]);
+        std::copy(data(), data() + size_, heap.get());
+        heap_ = std::move(heap);
+        capacity_ = capacity;
+    }
+};
+
+// Header fields of a request or response in the order they were added. Names
+// and values are packed into one arena, inline up to typical sizes, so most
+// messages are stored without allocating. A name may appear more than once.
+// Lookups are case-insensitive and compare a hash of the lowercased name,
+// computed once as each field is added, before comparing any bytes; known
+// names are also classified as they are added and can be looked up by their
+// KnownHeader alone. Views handed out are valid until the fields are next
+// modified.
+class HeaderFields {
+public:
+    struct Field {
+        boost::string_view name;
+        boost::string_view value;
+    };
+
+    class Iterator {
+    public:
+        Iterator(const HeaderFields &fields, size_t index) : fields_(&fields), index_(index) {}
+
+        Field operator*() const {
+            return (*fields_)[index_];
+        }
+
+        Iterator &operator++() {
+            ++index_;
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) const {
+            return index_ != other.index_;
+        }
+
+    private:
+        const HeaderFields *fields_;
+        size_t index_;
+    };
+
+    HeaderFields() = default;
+
+    HeaderFields(std::initializer_list<std::pair<boost::string_view, boost::string_view>> fields) {
+        for (const auto &field : fields) {
+            Add(field.first, field.second);
+        }
+    }
+
+    // Returns what the name was classified as.
+    KnownHeader Add(boost::string_view name, boost::string_view value) {
+        uint32_t hash = header_name_hash(name);
+        Entry entry{hash, static_cast<uint32_t>(bytes_.size()), static_cast<uint32_t>(name.size()),
+                    static_cast<uint32_t>(value.size()), classify_header(name, hash)};
+        bytes_.append(name.data(), name.size());
+        bytes_.append(value.data(), value.size());
+        entries_.append(&entry, 1);
+        return entry.known;
+    }
+
+    // Replaces every field with the name by one with value.
+    void Set(boost::string_view name, boost::string_view value) {
+        Remove(name);
+        Add(name, value);
+    }
+
+    void Remove(boost::string_view name) {
+        uint32_t key = header_name_hash(name);
+        for (size_t i = entries_.size(); i > 0; --i) {
+            if (matches(i - 1, key, name)) {
+                erase(i - 1);
+            }
+        }
+    }
+
+    // First value with the name, or an empty view if there is none.
+    boost::string_view Find(boost::string_view name) const {
+        uint32_t key = header_name_hash(name);
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            if (matches(i, key, name)) {
+                return (*this)[i].value;
+            }
+        }
+        return boost::string_view();
+    }
+
+    boost::string_view Find(KnownHeader known) const {
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            if (entries_.data()[i].known == known) {
+                return (*this)[i].value;
+            }
+        }
+        return boost::string_view();
+    }
+
+    // Calls handler with every value of the name, in order.
+    template <typename Handler>
+    void FindAll(boost::string_view name, Handler handler) const {
+        uint32_t key = header_name_hash(name);
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            if (matches(i, key, name)) {
+                handler((*this)[i].value);
+            }
+        }
+    }
+
+    Field operator[](size_t index) const {
+        const Entry &entry = entries_.data()[index];
+        const char *bytes = bytes_.data() + entry.offset;
+        return Field{boost::string_view(bytes, entry.nameSize),
+                     boost::string_view(bytes + entry.nameSize, entry.valueSize)};
+    }
+
+    size_t Size() const {
+        return entries_.size();
+    }
+
+    bool Empty() const {
+        return entries_.size() == 0;
+    }
+
+    void Clear() {
+        entries_.clear();
+        bytes_.clear();
+    }
+
+    Iterator begin() const {
+        return Iterator(*this, 0);
+    }
+
+    Iterator end() const {
+        return Iterator(*this, entries_.size());
+    }
+
+private:
+    static const size_t kInlineFields = 16;
+    static const size_t kInlineBytes = 1024;
+
+    struct Entry {
+        uint32_t hash;
+        uint32_t offset;
+        uint32_t nameSize;
+        uint32_t valueSize;
+        KnownHeader known;
+    };
+
+    InlineArray<Entry, kInlineFields> entries_;
+    InlineArray<char, kInlineBytes> bytes_;
+
+    bool matches(size_t index, uint32_t key, boost::string_view name) const {
+        const Entry &entry = entries_.data()[index];
+        return entry.hash == key && entry.nameSize == name.size() && ascii_iequals((*this)[index].name, name);
+    }
+
+    // Removes a field and its bytes, keeping the arena packed.
+    void erase(size_t index) {
+        Entry *entries = entries_.data();
+        uint32_t offset = entries[index].offset;
+        uint32_t size = entries[index].nameSize + entries[index].valueSize;
+        bytes_.erase(offset, size);
+        entries_.erase(index, 1);
+        for (size_t i = index; i < entries_.size(); ++i) {
+            entries[i].offset -= size;
+        }
+    }
+};
+
+// Bitmask of the line feeds in 64 bytes, bit i set for block[i]. x86 builds
+// pick SSE2 or, where the CPU has it, AVX2 at startup; others use a loop.
+using NewlineMaskFunction = uint64_t (*)(const char *block);
+
+inline uint64_t newline_mask_scalar(const char *block) {
+    uint64_t mask = 0;
+    for (unsigned i = 0; i < 64; ++i) {
+        mask |= static_cast<uint64_t>(block[i] == '\n') << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) inline uint64_t newline_mask_sse2(const char *block) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + i * 16));
+        mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline))))
+                << (i * 16);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"))) inline uint64_t newline_mask_avx2(const char *block) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+    __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + 32));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline))) |
+           static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline))))
+                   << 32;
+}
+#endif
+
+inline NewlineMaskFunction select_newline_mask() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return newline_mask_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return newline_mask_sse2;
+    }
+#endif
+    return newline_mask_scalar;
+}
+
+static const NewlineMaskFunction kNewlineMask = select_newline_mask();
+
+// Finds line feeds a 64-byte block at a time and keeps the mask of the last
+// block, so each further line ending in it costs a bit scan. Offsets are
+// relative to the data passed in, which may move between calls as long as
+// the bytes already scanned keep their offsets; Reset() when they do not.
+class NewlineScanner {
+public:
+    void Reset() {
+        blockStart_ = 0;
+        blockEnd_ = 0;
+        mask_ = 0;
+    }
+
+    // Offset of the first '\n' at or after pos, or size if there is none.
+    size_t Find(const char *data, size_t pos, size_t size) {
+        for (;;) {
+            if (pos >= blockStart_ && pos < blockEnd_) {
+                uint64_t bits = mask_ >> (pos - blockStart_);
+                if (bits != 0) {
+                    return pos + __builtin_ctzll(bits);
+                }
+                pos = blockEnd_;
+            }
+            if (pos >= size) {
+                return size;
+            }
+            scan(data, pos, size);
+        }
+    }
+
+private:
+    size_t blockStart_ = 0;
+    size_t blockEnd_ = 0;
+    uint64_t mask_ = 0;
+
+    void scan(const char *data, size_t pos, size_t size) {
+        size_t length = std::min<size_t>(size - pos, 64);
+        if (length == 64) {
+            mask_ = kNewlineMask(data + pos);
+        } else {
+            // A partial block is padded out; the next call rescans from its end.
+            char block[64] = {};
+            std::memcpy(block, data + pos, length);
+            mask_ = kNewlineMask(block) & ((uint64_t(1) << length) - 1);
+        }
+        blockStart_ = pos;
+        blockEnd_ = pos + length;
+    }
+};
+
+// Incremental parser for an HTTP/1.x response head (status line and headers).
+//
+// Parse() is given the whole buffered response each time more bytes arrive
+// and resumes scanning where the previous call stopped, so the buffer may be
+// reallocated between calls. The status line is stored as offsets, and Head()
+// and Reason() return views into the buffer passed to the last Parse() call,
+// valid until that buffer is modified. Header fields are copied into a
+// HeaderFields as they are parsed.
+class HttpResponseParser {
+public:
+    enum Result {
+        NeedMore,
+        Done,
+        Invalid,
+    };
+
+    static const size_t kMaxHeaders = 64;
+    static const size_t kMaxHeadSize = 64 * 1024;
+
+    void Reset() {
+        data_ = nullptr;
+        state_ = StatusLine;
+        lineStart_ = 0;
+        scanned_ = 0;
+        scanner_.Reset();
+        headSize_ = 0;
+        headers_.Clear();
+        minorVersion_ = 0;
+        status_ = 0;
+        contentLength_ = -1;
+        chunked_ = false;
+        close_ = false;
+        keepAlive_ = false;
+    }
+
+    Result Parse(const char *data, size_t size) {
+        data_ = data;
+
+        while (state_ != Complete) {
+            size_t lineEnd = scanner_.Find(data, scanned_, size);
+            if (lineEnd == size) {
+                scanned_ = size;
+                return size > kMaxHeadSize ? Invalid : NeedMore;
+            }
+
+            size_t end = lineEnd;
+            if (end > lineStart_ && data[end - 1] == '\r') {
+                --end;
+            }
+
+            if (!parse_line(lineStart_, end)) {
+                return Invalid;
+            }
+
+            lineStart_ = scanned_ = lineEnd + 1;
+        }
+
+        headSize_ = lineStart_;
+        return Done;
+    }
+
+    // Bytes taken by the status line, headers and the empty line after them.
+    size_t HeadSize() const {
+        return headSize_;
+    }
+
+    boost::string_view Head() const {
+        return boost::string_view(data_, headSize_);
+    }
+
+    int StatusCode() const {
+        return status_;
+    }
+
+    boost::string_view Reason() const {
+        return view(reason_);
+    }
+
+    int MinorVersion() const {
+        return minorVersion_;
+    }
+
+    const HeaderFields &Fields() const {
+        return headers_;
+    }
+
+    // First value of the named header, or an empty view if absent.
+    boost::string_view Find(boost::string_view name) const {
+        return headers_.Find(name);
+    }
+
+    boost::string_view Find(KnownHeader known) const {
+        return headers_.Find(known);
+    }
+
+    bool HasContentLength() const {
+        return contentLength_ >= 0;
+    }
+
+    uint64_t ContentLength() const {
+        return static_cast<uint64_t>(contentLength_);
+    }
+
+    bool IsChunked() const {
+        return chunked_;
+    }
+
+    bool KeepAlive() const {
+        return !close_ && (minorVersion_ >= 1 || keepAlive_);
+    }
+
+private:
+    struct Span {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    enum State {
+        StatusLine,
+        Headers,
+        Complete,
+    };
+
+    const char *data_ = nullptr;
+    State state_ = StatusLine;
+    size_t lineStart_ = 0;
+    size_t scanned_ = 0;
+    NewlineScanner scanner_;
+    size_t headSize_ = 0;
+
+    int minorVersion_ = 0;
+    int status_ = 0;
+    Span reason_{0, 0};
+
+    HeaderFields headers_;
+
+    int64_t contentLength_ = -1;
+    bool chunked_ = false;
+    bool close_ = false;
+    bool keepAlive_ = false;
+
+    boost::string_view view(Span span) const {
+        return boost::string_view(data_ + span.offset, span.size);
+    }
+
+    Span span(boost::string_view value) const {
+        return Span{static_cast<uint32_t>(value.data() - data_), static_cast<uint32_t>(value.size())};
+    }
+
+    bool parse_line(size_t begin, size_t end) {
+        boost::string_view line(data_ + begin, end - begin);
+
+        switch (state_) {
+            case StatusLine:
+                return parse_status_line(line);
+            case Headers:
+                if (line.empty()) {
+                    state_ = Complete;
+                    return true;
+                }
+                return parse_header_line(line);
+            case Complete:
+                break;
+        }
+        return false;
+    }
+
+    // HTTP/1.x SP 3DIGIT SP reason
+    bool parse_status_line(boost::string_view line) {
+        if (line.size() < 12 || line.compare(0, 7, "HTTP/1.") != 0 ||
+            line[7] < '0' || line[7] > '9' || line[8] != ' ') {
+            return false;
+        }
+
+        int status = 0;
+        for (size_t i = 9; i < 12; ++i) {
+            if (line[i] < '0' || line[i] > '9') {
+                return false;
+            }
+            status = status * 10 + (line[i] - '0');
+        }
+
+        if (line.size() > 12 && line[12] != ' ') {
+            return false;
+        }
+
+        minorVersion_ = line[7] - '0';
+        status_ = status;
+        reason_ = span(line.size() > 13 ? line.substr(13) : boost::string_view(line.data() + line.size(), 0));
+        state_ = Headers;
+        return true;
+    }
+
+    bool parse_header_line(boost::string_view line) {
+        // Obsolete line folding is not supported.
+        if (line.front() == ' ' || line.front() == '\t' || headers_.Size() == kMaxHeaders) {
+            return false;
+        }
+
+        size_t colon = line.find(':');
+        if (colon == 0 || colon == boost::string_view::npos) {
+            return false;
+        }
+
+        boost::string_view name = line.substr(0, colon);
+        boost::string_view value = trim_ows(line.substr(colon + 1));
+        if (name.back() == ' ' || name.back() == '\t') {
+            return false;
+        }
+
+        return apply_header(headers_.Add(name, value), value);
+    }
+
+    bool apply_header(KnownHeader known, boost::string_view value) {
+        switch (known) {
+            case KnownHeader::ContentLength: {
+                int64_t length = 0;
+                if (value.empty() || value.size() > 18) {
+                    return false;
+                }
+                for (char c : value) {
+                    if (c < '0' || c > '9') {
+                        return false;
+                    }
+                    length = length * 10 + (c - '0');
+                }
+                if (contentLength_ >= 0 && contentLength_ != length) {
+                    return false;
+                }
+                contentLength_ = length;
+                break;
+            }
+            case KnownHeader::TransferEncoding: {
+                // Only the last transfer coding decides how the body is framed.
+                size_t comma = value.rfind(',');
+                boost::string_view last = trim_ows(comma == boost::string_view::npos ? value : value.substr(comma + 1));
+                chunked_ = ascii_iequals(last, "chunked");
+                break;
+            }
+            case KnownHeader::Connection:
+                while (!value.empty()) {
+                    size_t comma = value.find(',');
+                    boost::string_view token = trim_ows(value.substr(0, comma));
+                    close_ = close_ || ascii_iequals(token, "close");
+                    keepAlive_ = keepAlive_ || ascii_iequals(token, "keep-alive");
+                    value = comma == boost::string_view::npos ? boost::string_view() : value.substr(comma + 1);
+                }
+                break;
+            default:
+                break;
+        }
+        return true;
+    }
+};
+
+// Streaming decoder for the chunked transfer coding.
+//
+// Decode() consumes as much of the input as it can and passes every piece of
+// chunk data to the callback as soon as it has been seen, so a single chunk
+// may be delivered in several slices and nothing is buffered. Chunk
+// extensions and trailer fields are skipped.
+class ChunkedDecoder {
+public:
+    enum Result {
+        NeedMore,
+        Done,
+        Invalid,
+    };
+
+    static const size_t kMaxLineSize = 64 * 1024;
+
+    void Reset() {
+        state_ = Size;
+        remaining_ = 0;
+        digits_ = 0;
+        lineSize_ = 0;
+    }
+
+    // Sets consumed to the number of input bytes used; the rest, if any,
+    // follows the body.
+    template <typename Callback>
+    Result Decode(const char *data, size_t size, size_t &consumed, Callback &&onData) {
+        size_t pos = 0;
+        scanner_.Reset();
+
+        while (pos < size && state_ != Complete) {
+            char c = data[pos];
+
+            switch (state_) {
+                case Size: {
+                    // A size line that has fully arrived is taken in one go,
+                    // otherwise it is read a byte at a time.
+                    if (digits_ == 0) {
+                        size_t eol = scanner_.Find(data, pos, size);
+                        if (eol < size) {
+                            if (!parse_size_line(data + pos, data + eol)) {
+                                return Invalid;
+                            }
+                            end_size_line();
+                            pos = eol + 1;
+                            break;
+                        }
+                    }
+                    int digit = hex_value(c);
+                    if (digit >= 0) {
+                        // 15 hex digits keep the size well inside 64 bits.
+                        if (++digits_ > 15) {
+                            return Invalid;
+                        }
+                        remaining_ = remaining_ * 16 + digit;
+                        ++pos;
+                    } else if (digits_ == 0) {
+                        return Invalid;
+                    } else if (c == ';' || c == ' ' || c == '\t') {
+                        state_ = Extension;
+                        ++pos;
+                    } else if (c == '\r') {
+                        state_ = SizeLF;
+                        ++pos;
+                    } else if (c == '\n') {
+                        end_size_line();
+                        ++pos;
+                    } else {
+                        return Invalid;
+                    }
+                    break;
+                }
+                case Extension: {
+                    size_t end = scanner_.Find(data, pos, size);
+                    lineSize_ += end - pos;
+                    if (lineSize_ > kMaxLineSize) {
+                        return Invalid;
+                    }
+                    pos = end;
+                    if (end < size) {
+                        end_size_line();
+                        ++pos;
+                    }
+                    break;
+                }
+                case SizeLF:
+                    if (c != '\n') {
+                        return Invalid;
+                    }
+                    end_size_line();
+                    ++pos;
+                    break;
+                case Data: {
+                    size_t n = static_cast<size_t>(std::min<uint64_t>(remaining_, size - pos));
+                    onData(data + pos, n);
+                    pos += n;
+                    remaining_ -= n;
+                    if (remaining_ == 0) {
+                        state_ = DataCR;
+                    }
+                    break;
+                }
+                case DataCR:
+                    if (c == '\r') {
+                        state_ = DataLF;
+                    } else if (c == '\n') {
+                        start_chunk();
+                    } else {
+                        return Invalid;
+                    }
+                    ++pos;
+                    break;
+                case DataLF:
+                    if (c != '\n') {
+                        return Invalid;
+                    }
+                    start_chunk();
+                    ++pos;
+                    break;
+                case TrailerStart:
+                    if (c == '\r') {
+                        state_ = FinalLF;
+                        ++pos;
+                    } else if (c == '\n') {
+                        state_ = Complete;
+                        ++pos;
+                    } else {
+                        lineSize_ = 0;
+                        state_ = Trailer;
+                    }
+                    break;
+                case Trailer: {
+                    size_t end = scanner_.Find(data, pos, size);
+                    lineSize_ += end - pos;
+                    if (lineSize_ > kMaxLineSize) {
+                        return Invalid;
+                    }
+                    pos = end;
+                    if (end < size) {
+                        state_ = TrailerStart;
+                        ++pos;
+                    }
+                    break;
+                }
+                case FinalLF:
+                    if (c != '\n') {
+                        return Invalid;
+                    }
+                    state_ = Complete;
+                    ++pos;
+                    break;
+                case Complete:
+                    break;
+            }
+        }
+
+        consumed = pos;
+        return state_ == Complete ? Done : NeedMore;
+    }
+
+private:
+    enum State {
+        Size,
+        Extension,
+        SizeLF,
+        Data,
+        DataCR,
+        DataLF,
+        TrailerStart,
+        Trailer,
+        FinalLF,
+        Complete,
+    };
+
+    State state_ = Size;
+    uint64_t remaining_ = 0;
+    int digits_ = 0;
+    size_t lineSize_ = 0;
+    NewlineScanner scanner_;
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        c = ascii_lower(c);
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        return -1;
+    }
+
+    // Parses a whole size line without its '\n' into remaining_.
+    bool parse_size_line(const char *p, const char *end) {
+        if (end > p && end[-1] == '\r') {
+            --end;
+        }
+        const char *digits = p;
+        for (int digit; p < end && (digit = hex_value(*p)) >= 0; ++p) {
+            remaining_ = remaining_ * 16 + digit;
+        }
+        if (p == digits || p - digits > 15) {
+            return false;
+        }
+        if (p == end) {
+            return true;
+        }
+        return (*p == ';' || *p == ' ' || *p == '\t') && static_cast<size_t>(end - p) <= kMaxLineSize;
+    }
+
+    void end_size_line() {
+        lineSize_ = 0;
+        state_ = remaining_ == 0 ? TrailerStart : Data;
+    }
+
+    void start_chunk() {
+        state_ = Size;
+        remaining_ = 0;
+        digits_ = 0;
+    }
+};
+
+// Inflates a gzip or deflate coded body as it arrives. Output is handed on a
+// window at a time, so memory stays fixed however large the body is.
+class ContentDecoder {
+public:
+    static const size_t kWindowSize = 16 * 1024;
+
+    enum Coding {
+        Identity,
+        Gzip,
+        Deflate,
+    };
+
+    // The coding named by a Content-Encoding value. Anything other than a
+    // single gzip or deflate coding is passed through as it is.
+    static Coding Parse(boost::string_view value) {
+        value = trim_ows(value);
+        if (ascii_iequals(value, "gzip") || ascii_iequals(value, "x-gzip")) {
+            return Gzip;
+        }
+        if (ascii_iequals(value, "deflate")) {
+            return Deflate;
+        }
+        return Identity;
+    }
+
+    ContentDecoder() = default;
+    ContentDecoder(const ContentDecoder &) = delete;
+    ContentDecoder &operator=(const ContentDecoder &) = delete;
+
+    ~ContentDecoder() {
+        if (initialized_) {
+            inflateEnd(&stream_);
+        }
+    }
+
+    // Starts a body in coding; Identity turns decoding off. Returns false if
+    // zlib could not be set up.
+    bool Start(Coding coding) {
+        coding_ = coding;
+        finished_ = coding == Identity;
+        empty_ = true;
+        raw_ = false;
+        if (coding == Identity) {
+            return true;
+        }
+
+        int bits = coding == Gzip ? MAX_WBITS + 16 : MAX_WBITS;
+        int status = initialized_ ? inflateReset2(&stream_, bits) : inflateInit2(&stream_, bits);
+        if (status != Z_OK) {
+            coding_ = Identity;
+            return false;
+        }
+        initialized_ = true;
+        if (!window_) {
+            window_.reset(new char[kWindowSize]);
+        }
+        return true;
+    }
+
+    bool Active() const {
+        return coding_ != Identity;
+    }
+
+    // Whether the coded data has ended or none came; always true when not
+    // decoding.
+    bool Finished() const {
+        return finished_ || empty_;
+    }
+
+    // Inflates size bytes of coded data, passing every window of output to
+    // the callback. Returns false if the data is corrupt.
+    template <typename Callback>
+    bool Decode(const char *data, size_t size, Callback &&onData) {
+        bool first = empty_;
+        empty_ = false;
+        stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        stream_.avail_in = static_cast<uInt>(size);
+
+        for (;;) {
+            if (finished_) {
+                // A gzip body may hold several members; anything after a
+                // deflate stream is ignored.
+                if (stream_.avail_in == 0 || coding_ != Gzip) {
+                    return true;
+                }
+                if (inflateReset(&stream_) != Z_OK) {
+                    return false;
+                }
+                finished_ = false;
+            }
+
+            stream_.next_out = reinterpret_cast<Bytef *>(window_.get());
+            stream_.avail_out = static_cast<uInt>(kWindowSize);
+            int status = inflate(&stream_, Z_NO_FLUSH);
+
+            // Some servers send deflate without the zlib wrapper it calls for.
+            if (status == Z_DATA_ERROR && coding_ == Deflate && !raw_ && first && stream_.total_out == 0) {
+                if (inflateReset2(&stream_, -MAX_WBITS) != Z_OK) {
+                    return false;
+                }
+                raw_ = true;
+                stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+                stream_.avail_in = static_cast<uInt>(size);
+                continue;
+            }
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                return false;
+            }
+
+            size_t produced = kWindowSize - stream_.avail_out;
+            if (produced != 0) {
+                onData(window_.get(), produced);
+            }
+            finished_ = status == Z_STREAM_END;
+            if (!finished_ && stream_.avail_in == 0 && stream_.avail_out != 0) {
+                return true;
+            }
+        }
+    }
+
+private:
+    z_stream stream_ = z_stream();
+    std::unique_ptr<char[]> window_;
+    Coding coding_ = Identity;
+    bool initialized_ = false;
+    bool finished_ = true;
+    bool empty_ = true;
+    bool raw_ = false;
+};
+
+const size_t ContentDecoder::kWindowSize;
+
+// HPACK (RFC 7541) header compression for HTTP/2.
+static const std::pair<const char *, const char *> kHpackStaticTable[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const size_t kHpackStaticSize = sizeof(kHpackStaticTable) / sizeof(kHpackStaticTable[0]);
+
+// RFC 7541 Appendix B: Huffman code and its length in bits for every octet,
+// followed by EOS.
+static const uint32_t kHuffmanCodes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+
+static const uint8_t kHuffmanLengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+
+// Canonical decoding tables built from the code lengths: for every length,
+// the first code of that length and where its symbols start in kSymbols.
+class HuffmanDecoder {
+public:
+    static const HuffmanDecoder &Get() {
+        static const HuffmanDecoder decoder;
+        return decoder;
+    }
+
+    // Fails on EOS, on padding longer than 7 bits and on padding that is not
+    // a prefix of EOS.
+    bool Decode(const uint8_t *data, size_t size, std::string &out) const {
+        uint32_t code = 0;
+        unsigned length = 0;
+        for (size_t i = 0; i < size; ++i) {
+            for (int bit = 7; bit >= 0; --bit) {
+                code = (code << 1) | ((data[i] >> bit) & 1);
+                ++length;
+                if (length > 30) {
+                    return false;
+                }
+
+                uint32_t index = code - firstCode_[length];
+                if (code >= firstCode_[length] && index < count_[length]) {
+                    uint16_t symbol = symbols_[offset_[length] + index];
+                    if (symbol == 256) {
+                        return false;
+                    }
+                    out += static_cast<char>(symbol);
+                    code = 0;
+                    length = 0;
+                }
+            }
+        }
+        return length <= 7 && code == (1u << length) - 1;
+    }
+
+private:
+    uint32_t firstCode_[31] = {};
+    uint32_t count_[31] = {};
+    uint32_t offset_[31] = {};
+    uint16_t symbols_[257] = {};
+
+    HuffmanDecoder() {
+        for (uint16_t symbol = 0; symbol < 257; ++symbol) {
+            ++count_[kHuffmanLengths[symbol]];
+        }
+
+        uint32_t code = 0;
+        uint32_t offset = 0;
+        for (unsigned length = 1; length <= 30; ++length) {
+            code = (code + count_[length - 1]) << 1;
+            firstCode_[length] = code;
+            offset_[length] = offset;
+            offset += count_[length];
+        }
+
+        for (uint16_t symbol = 0; symbol < 257; ++symbol) {
+            unsigned length = kHuffmanLengths[symbol];
+            symbols_[offset_[length] + kHuffmanCodes[symbol] - firstCode_[length]] = symbol;
+        }
+    }
+};
+
+// The dynamic table shared by an encoder or decoder and its peer. Entries
+// are numbered from the newest, after the static table.
+class HpackTable {
+public:
+    // Size of an entry as defined by RFC 7541 section 4.1.
+    static size_t EntrySize(boost::string_view name, boost::string_view value) {
+        return name.size() + value.size() + 32;
+    }
+
+    size_t MaxSize() const {
+        return maxSize_;
+    }
+
+    void SetMaxSize(size_t size) {
+        maxSize_ = size;
+        evict(0);
+    }
+
+    void Add(std::string name, std::string value) {
+        size_t entrySize = EntrySize(name, value);
+        evict(entrySize);
+        // An entry larger than the table empties it and is not stored.
+        if (entrySize <= maxSize_) {
+            entries_.emplace_front(std::move(name), std::move(value));
+            size_ += entrySize;
+        }
+    }
+
+    // index is 1-based over the static and dynamic tables together.
+    const std::pair<std::string, std::string> *Get(size_t index) const {
+        if (index == 0 || index > kHpackStaticSize + entries_.size()) {
+            return nullptr;
+        }
+        if (index <= kHpackStaticSize) {
+            return &static_entries()[index - 1];
+        }
+        return &entries_[index - kHpackStaticSize - 1];
+    }
+
+    // Returns the index of an entry matching name and value, or failing that
+    // one matching only name, with exact set accordingly; 0 if there is none.
+    size_t Find(boost::string_view name, boost::string_view value, bool &exact) const {
+        size_t nameIndex = 0;
+        exact = false;
+        for (size_t i = 0; i < kHpackStaticSize; ++i) {
+            if (name == kHpackStaticTable[i].first) {
+                if (value == kHpackStaticTable[i].second) {
+                    exact = true;
+                    return i + 1;
+                }
+                if (nameIndex == 0) {
+                    nameIndex = i + 1;
+                }
+            }
+        }
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            if (entries_[i].first == name) {
+                if (entries_[i].second == value) {
+                    exact = true;
+                    return kHpackStaticSize + i + 1;
+                }
+                if (nameIndex == 0) {
+                    nameIndex = kHpackStaticSize + i + 1;
+                }
+            }
+        }
+        return nameIndex;
+    }
+
+private:
+    std::deque<std::pair<std::string, std::string>> entries_;
+    size_t size_ = 0;
+    size_t maxSize_ = 4096;
+
+    static const std::vector<std::pair<std::string, std::string>> &static_entries() {
+        static const std::vector<std::pair<std::string, std::string>> entries(
+                std::begin(kHpackStaticTable), std::end(kHpackStaticTable));
+        return entries;
+    }
+
+    void evict(size_t room) {
+        while (!entries_.empty() && size_ + room > maxSize_) {
+            size_ -= EntrySize(entries_.back().first, entries_.back().second);
+            entries_.pop_back();
+        }
+    }
+};
+
+class HpackDecoder {
+public:
+    // The table size limit announced to the peer in SETTINGS.
+    explicit HpackDecoder(size_t maxTableSize = 4096) : maxTableSize_(maxTableSize) {
+        table_.SetMaxSize(maxTableSize);
+    }
+
+    // Decodes a complete header block, appending its fields to headers.
+    // Returns false on any malformed input, which is a connection error.
+    bool Decode(const uint8_t *data, size_t size, HeaderFields &headers) {
+        const uint8_t *end = data + size;
+        bool fieldSeen = false;
+
+        while (data != end) {
+            uint8_t first = *data;
+            uint64_t index;
+
+            if (first & 0x80) {
+                // Indexed header field.
+                if (!decode_integer(data, end, 7, index)) {
+                    return false;
+                }
+                const std::pair<std::string, std::string> *entry = table_.Get(index);
+                if (entry == nullptr) {
+                    return false;
+                }
+                headers.Add(entry->first, entry->second);
+                fieldSeen = true;
+                continue;
+            }
+
+            if ((first & 0xe0) == 0x20) {
+                // Size updates are only allowed at the start of a block.
+                if (fieldSeen || !decode_integer(data, end, 5, index) || index > maxTableSize_) {
+                    return false;
+                }
+                table_.SetMaxSize(index);
+                continue;
+            }
+
+            // Literal with incremental indexing, without indexing or never indexed.
+            bool indexed = (first & 0xc0) == 0x40;
+            if (!decode_integer(data, end, indexed ? 6 : 4, index)) {
+                return false;
+            }
+
+            std::string name;
+            if (index == 0) {
+                if (!decode_string(data, end, name)) {
+                    return false;
+                }
+            } else {
+                const std::pair<std::string, std::string> *entry = table_.Get(index);
+                if (entry == nullptr) {
+                    return false;
+                }
+                name = entry->first;
+            }
+
+            std::string value;
+            if (!decode_string(data, end, value)) {
+                return false;
+            }
+
+            if (indexed) {
+                table_.Add(name, value);
+            }
+            headers.Add(name, value);
+            fieldSeen = true;
+        }
+        return true;
+    }
+
+private:
+    HpackTable table_;
+    size_t maxTableSize_;
+
+    static bool decode_integer(const uint8_t *&data, const uint8_t *end, unsigned prefix, uint64_t &value) {
+        if (data == end) {
+            return false;
+        }
+
+        uint8_t mask = static_cast<uint8_t>((1u << prefix) - 1);
+        value = *data++ & mask;
+        if (value < mask) {
+            return true;
+        }
+
+        for (unsigned shift = 0; shift <= 28; shift += 7) {
+            if (data == end) {
+                return false;
+            }
+            uint8_t byte = *data++;
+            value += static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool decode_string(const uint8_t *&data, const uint8_t *end, std::string &out) {
+        if (data == end) {
+            return false;
+        }
+
+        bool huffman = (*data & 0x80) != 0;
+        uint64_t length;
+        if (!decode_integer(data, end, 7, length) || length > static_cast<uint64_t>(end - data)) {
+            return false;
+        }
+
+        const uint8_t *begin = data;
+        data += length;
+        if (huffman) {
+            return HuffmanDecoder::Get().Decode(begin, length, out);
+        }
+        out.assign(reinterpret_cast<const char *>(begin), length);
+        return true;
+    }
+};
+
+// Strings are sent without Huffman coding. Fields that repeat on every
+// request are added to the dynamic table so later requests send them as a
+// single index; :path and fields too large for the table are sent literally.
+class HpackEncoder {
+public:
+    // Applies the peer's SETTINGS_HEADER_TABLE_SIZE; the change is announced
+    // at the start of the next header block.
+    void SetMaxTableSize(size_t size) {
+        size = std::min<size_t>(size, 4096);
+        if (size != table_.MaxSize()) {
+            table_.SetMaxSize(size);
+            sizeUpdate_ = true;
+        }
+    }
+
+    void Encode(const HeaderFields &headers, std::string &out) {
+        if (sizeUpdate_) {
+            encode_integer(out, 0x20, 5, table_.MaxSize());
+            sizeUpdate_ = false;
+        }
+
+        for (const HeaderFields::Field header : headers) {
+            bool exact;
+            size_t index = table_.Find(header.name, header.value, exact);
+            if (exact) {
+                encode_integer(out, 0x80, 7, index);
+                continue;
+            }
+
+            bool indexed = header.name != ":path" &&
+                           HpackTable::EntrySize(header.name, header.value) <= table_.MaxSize() / 4;
+            encode_integer(out, indexed ? 0x40 : 0x00, indexed ? 6 : 4, index);
+            if (index == 0) {
+                encode_string(out, header.name);
+            }
+            encode_string(out, header.value);
+
+            if (indexed) {
+                table_.Add(std::string(header.name), std::string(header.value));
+            }
+        }
+    }
+
+private:
+    HpackTable table_;
+    bool sizeUpdate_ = false;
+
+    static void encode_integer(std::string &out, uint8_t flags, unsigned prefix, uint64_t value) {
+        uint8_t mask = static_cast<uint8_t>((1u << prefix) - 1);
+        if (value < mask) {
+            out += static_cast<char>(flags | value);
+            return;
+        }
+
+        out += static_cast<char>(flags | mask);
+        value -= mask;
+        while (value >= 0x80) {
+            out += static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+
+    static void encode_string(std::string &out, boost::string_view value) {
+        encode_integer(out, 0x00, 7, value.size());
+        out.append(value.data(), value.size());
+    }
+};
+
+// Destination for response bodies. Write() is called with each piece of the
+// body as it is received and blocks until the data has been accepted, so a
+// slow sink holds back further reads from the socket.
+class BodySink {
+public:
+    virtual ~BodySink() = default;
+
+    // Returns false if the data could not be written.
+    virtual bool Write(const char *data, size_t size) = 0;
+
+    // A sink writing to a regular file may let the client move body bytes
+    // into it with splice(), bypassing user space. Returns the descriptor,
+    // with anything buffered flushed, and sets offset to where the next bytes
+    // go (-1 for the file position) and limit to how many it takes; -1 if the
+    // sink cannot be spliced into.
+    virtual int SpliceTo(int64_t &offset, uint64_t &limit) {
+        (void) offset;
+        (void) limit;
+        return -1;
+    }
+
+    // Accounts for bytes spliced into the descriptor from SpliceTo().
+    virtual void Spliced(size_t size) {
+        (void) size;
+    }
+};
+
+class FileSink : public BodySink {
+public:
+    explicit FileSink(FILE *file) : file_(file) {
+        struct stat info;
+        regular_ = ::fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode);
+    }
+
+    bool Write(const char *data, size_t size) override {
+        return std::fwrite(data, 1, size, file_) == size;
+    }
+
+    int SpliceTo(int64_t &offset, uint64_t &limit) override {
+        if (!regular_ || std::fflush(file_) != 0) {
+            return -1;
+        }
+        offset = -1;
+        limit = UINT64_MAX;
+        return fileno(file_);
+    }
+
+private:
+    FILE *file_;
+    bool regular_ = false;
+};
+
+// Writes the bodies of concurrent requests to one sink whole and in request
+// order. Each request writes to its own part: the part of the oldest
+// unfinished request goes straight through to the sink, and later ones are
+// held, in memory and then in a temporary file, until every request before
+// them has finished.
+class OrderedOutput {
+public:
+    explicit OrderedOutput(BodySink &out) : out_(out) {}
+
+    // The sink for request number order, counting from 0 without gaps.
+    BodySink *Part(size_t order) {
+        std::unique_ptr<PartSink> &part = parts_[order];
+        if (!part) {
+            part.reset(new PartSink(*this, order));
+        }
+        return part.get();
+    }
+
+    // Called once request number order will write nothing more.
+    void Finish(size_t order) {
+        Part(order);
+        parts_[order]->finished_ = true;
+
+        while (!parts_.empty() && parts_.begin()->first == next_ && parts_.begin()->second->finished_) {
+            parts_.erase(parts_.begin());
+            ++next_;
+            auto head = parts_.find(next_);
+            if (head != parts_.end()) {
+                head->second->release();
+            }
+        }
+    }
+
+private:
+    class PartSink : public BodySink {
+    public:
+        PartSink(OrderedOutput &owner, size_t order) : owner_(owner), order_(order) {}
+
+        ~PartSink() override {
+            if (spool_ != nullptr) {
+                std::fclose(spool_);
+            }
+        }
+
+        bool Write(const char *data, size_t size) override {
+            if (failed_) {
+                return false;
+            }
+            if (order_ == owner_.next_) {
+                failed_ = !owner_.out_.Write(data, size);
+            } else if (spool_ == nullptr && held_.size() + size <= kMemoryLimit) {
+                held_.append(data, size);
+            } else {
+                failed_ = !spool(data, size);
+            }
+            return !failed_;
+        }
+
+        // Only the part going through may be spliced into; the others take
+        // nothing for now, so the client reads their bodies instead.
+        int SpliceTo(int64_t &offset, uint64_t &limit) override {
+            int fd = owner_.out_.SpliceTo(offset, limit);
+            if (failed_ || order_ != owner_.next_) {
+                limit = 0;
+            }
+            return fd;
+        }
+
+        void Spliced(size_t size) override {
+            owner_.out_.Spliced(size);
+        }
+
+    private:
+        friend class OrderedOutput;
+
+        // Bodies held beyond this go to a temporary file.
+        static const size_t kMemoryLimit = 1024 * 1024;
+
+        OrderedOutput &owner_;
+        const size_t order_;
+        std::string held_;
+        FILE *spool_ = nullptr;
+        bool finished_ = false;
+        bool failed_ = false;
+
+        bool spool(const char *data, size_t size) {
+            if (spool_ == nullptr) {
+                spool_ = std::tmpfile();
+                if (spool_ == nullptr ||
+                    std::fwrite(held_.data(), 1, held_.size(), spool_) != held_.size()) {
+                    return false;
+                }
+                std::string().swap(held_);
+            }
+            return std::fwrite(data, 1, size, spool_) == size;
+        }
+
+        // Writes out what was held now that this part goes through.
+        void release() {
+            if (failed_) {
+                return;
+            }
+            if (spool_ != nullptr) {
+                std::rewind(spool_);
+                char buffer[64 * 1024];
+                size_t size;
+                while (!failed_ && (size = std::fread(buffer, 1, sizeof(buffer), spool_)) != 0) {
+                    failed_ = !owner_.out_.Write(buffer, size);
+                }
+                failed_ = failed_ || std::ferror(spool_) != 0;
+                std::fclose(spool_);
+                spool_ = nullptr;
+            } else if (!held_.empty()) {
+                failed_ = !owner_.out_.Write(held_.data(), held_.size());
+                std::string().swap(held_);
+            }
+            if (failed_) {
+                LOG_WARN("Error writing a held response body\n");
+            }
+        }
+    };
+
+    BodySink &out_;
+    std::map<size_t, std::unique_ptr<PartSink>> parts_;
+    // The request whose part goes straight through.
+    size_t next_ = 0;
+};
+
+// Connects a socket to the first of several endpoints that accepts, Happy
+// Eyeballs style (RFC 8305): attempts start one attempt delay apart, or at
+// once when the previous one fails, and the first socket to connect wins
+// while the others are closed.
+class Connector {
+public:
+    using Handler = std::function<void(const boost::system::error_code &, const asio::ip::tcp::endpoint &)>;
+
+    Connector(asio::io_service &io_service, ConnectionPool &pool)
+            : io_service_(io_service), pool_(pool), timer_(io_service) {}
+
+    void SetVerbose(bool verbose) {
+        verbose_ = verbose;
+    }
+
+    // On success the winning connection is moved into sock. host only labels
+    // messages.
+    void Connect(const std::string &host, std::vector<asio::ip::tcp::endpoint> endpoints,
+                 asio::ip::tcp::socket &sock, Handler handler) {
+        ++race_;
+        host_ = host;
+        endpoints_ = std::move(endpoints);
+        sock_ = &sock;
+        handler_ = std::move(handler);
+        attempts_.clear();
+        started_ = 0;
+        failed_ = 0;
+        start_attempt();
+    }
+
+    // Gives up a race in progress; the handler is called with operation_aborted.
+    void Cancel() {
+        if (handler_) {
+            finish(asio::error::operation_aborted, asio::ip::tcp::endpoint());
+        }
+    }
+
+private:
+    asio::io_service &io_service_;
+    ConnectionPool &pool_;
+    asio::steady_timer timer_;
+    bool verbose_ = true;
+
+    std::string host_;
+    std::vector<asio::ip::tcp::endpoint> endpoints_;
+    asio::ip::tcp::socket *sock_ = nullptr;
+    Handler handler_;
+
+    // Sockets still trying, how many attempts have been started and have
+    // failed, and generations that turn callbacks from a decided race, or
+    // from an attempt delay that was cancelled after it had already expired,
+    // into no-ops.
+    std::vector<std::unique_ptr<asio::ip::tcp::socket>> attempts_;
+    size_t started_ = 0;
+    size_t failed_ = 0;
+    unsigned race_ = 0;
+    unsigned delay_ = 0;
+
+    void start_attempt() {
+        if (started_ >= endpoints_.size()) {
+            if (failed_ == started_) {
+                finish(asio::error::host_not_found, asio::ip::tcp::endpoint());
+            }
+            return;
+        }
+
+        const asio::ip::tcp::endpoint dest = endpoints_[started_++];
+        const unsigned race = race_;
+        const size_t attempt = attempts_.size();
+
+        attempts_.emplace_back(new asio::ip::tcp::socket(io_service_));
+        attempts_.back()->async_connect(
+                dest, [this, race, attempt, dest](const boost::system::error_code &ec) {
+                    if (race == race_) {
+                        handle_attempt(attempt, dest, ec);
+                    }
+                });
+
+        if (started_ < endpoints_.size()) {
+            const unsigned delay = ++delay_;
+            timer_.expires_after(pool_.AttemptDelay());
+            timer_.async_wait([this, race, delay](const boost::system::error_code &ec) {
+                if (!ec && race == race_ && delay == delay_ && started_ < endpoints_.size()) {
+                    start_attempt();
+                }
+            });
+        }
+    }
+
+    void handle_attempt(size_t attempt, const asio::ip::tcp::endpoint &dest, const boost::system::error_code &ec) {
+        if (ec) {
+            ++failed_;
+            if (verbose_) {
+                LOG_WARN("{}: connecting to {}:{} failed: {}\n",
+                         host_, dest.address().to_string(), dest.port(), ec.message());
+            }
+
+            if (started_ < endpoints_.size()) {
+                // Do not wait out the delay once an attempt has failed. The
+                // delay may already have expired with its handler queued, so
+                // retire it as well as cancelling the timer.
+                ++delay_;
+                timer_.cancel();
+                start_attempt();
+            } else if (failed_ == started_) {
+                finish(ec, dest);
+            }
+            return;
+        }
+
+        *sock_ = std::move(*attempts_[attempt]);
+        finish(ec, dest);
+    }
+
+    void finish(const boost::system::error_code &ec, const asio::ip::tcp::endpoint &dest) {
+        ++race_;
+        timer_.cancel();
+        for (auto &other : attempts_) {
+            boost::system::error_code ignored;
+            other->close(ignored);
+        }
+        attempts_.clear();
+
+        Handler handler;
+        handler.swap(handler_);
+        handler(ec, dest);
+    }
+};
+
+// A minimal io_uring driven from an io_service, used instead of asio's
+// reactor for HttpClient socket I/O. Submissions queued while a handler runs
+// go to the kernel together in one io_uring_enter; completions are signalled
+// on an eventfd that asio waits on, so uring and asio work interleave on the
+// same thread. Receives are multishot and take their memory from a provided
+// buffer ring, so a connection needs one receive submission for its lifetime
+// rather than one per read.
+//
+// Needs Linux 6.0 or later; Create() returns null where io_uring, buffer
+// rings or multishot receives are unavailable.
+class IoUring {
+public:
+    // Called with the result of an operation as the kernel reports it: bytes
+    // transferred, 0 at end of stream or -errno. more is set while a multishot
+    // receive stays active. data is set for receives and is only valid during
+    // the call.
+    using Handler = std::function<void(int result, bool more, const char *data)>;
+
+    static const unsigned kBufferCount = 256;
+    static const size_t kBufferSize = 16 * 1024;
+    // Completions a connection can have outstanding: its connect, send and
+    // receive, and the cancellation of each with its own result.
+    static const unsigned kCompletionsPerConnection = 8;
+
+    // The completion queue is sized for connections using the ring at once,
+    // plus a completion for every receive buffer.
+    static std::unique_ptr<IoUring> Create(asio::io_service &io_service, unsigned entries, size_t connections,
+                                           std::string &error) {
+        std::unique_ptr<IoUring> ring(new IoUring(io_service));
+        if (!ring->setup(entries, connections, error)) {
+            ring.reset();
+        }
+        return ring;
+    }
+
+    ~IoUring() {
+        if (buffers_ != nullptr) {
+            ::munmap(buffers_, kBufferCount * kBufferSize);
+        }
+        if (bufferRing_ != nullptr) {
+            ::munmap(bufferRing_, kBufferCount * sizeof(io_uring_buf));
+        }
+        if (sqes_ != nullptr) {
+            ::munmap(sqes_, sqEntries_ * sizeof(io_uring_sqe));
+        }
+        if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+            ::munmap(cqRing_, cqRingSize_);
+        }
+        if (sqRing_ != nullptr) {
+            ::munmap(sqRing_, sqRingSize_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    // Receives into the buffer ring until the connection ends, an error
+    // occurs or the operation is cancelled.
+    uint64_t Receive(int fd, Handler handler) {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufferGroup;
+        return add(sqe, std::move(handler));
+    }
+
+    // Gathers the buffers of message, which must stay valid with them until
+    // the handler runs. A linked send only starts once the previous linked
+    // operation has succeeded, and fails with -ECANCELED otherwise.
+    uint64_t SendMsg(int fd, const msghdr *message, Handler handler) {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(message);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return add(sqe, std::move(handler));
+    }
+
+    // With link set, the next submission runs only if the connect succeeds.
+    uint64_t Connect(int fd, const sockaddr *address, socklen_t size, bool link, Handler handler) {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(address);
+        sqe->off = size;
+        if (link) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        return add(sqe, std::move(handler));
+    }
+
+    // The handler of a cancelled operation is never called.
+    void Cancel(uint64_t id) {
+        if (ops_.erase(id) == 0) {
+            return;
+        }
+
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = id;
+        sqe->user_data = 0;
+    }
+
+private:
+    static const uint16_t kBufferGroup = 0;
+
+    asio::io_service &io_service_;
+    asio::posix::stream_descriptor event_;
+    int fd_ = -1;
+    bool waiting_ = false;
+    bool submitScheduled_ = false;
+
+    void *sqRing_ = nullptr;
+    void *cqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    size_t cqRingSize_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    unsigned sqEntries_ = 0;
+
+    unsigned *sqHead_ = nullptr;
+    unsigned *sqTail_ = nullptr;
+    unsigned *sqArray_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned *cqHead_ = nullptr;
+    unsigned *cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+
+    unsigned *sqFlags_ = nullptr;
+
+    // Submission entries filled in but not yet handed to the kernel, and
+    // entries that did not fit in the ring yet, in order.
+    unsigned sqeTail_ = 0;
+    unsigned submitted_ = 0;
+    std::deque<io_uring_sqe> backlog_;
+
+    io_uring_buf *bufferRing_ = nullptr;
+    char *buffers_ = nullptr;
+    uint16_t bufferTail_ = 0;
+
+    uint64_t nextId_ = 1;
+    // Shared so a multishot handler survives being cancelled from within itself.
+    std::map<uint64_t, std::shared_ptr<Handler>> ops_;
+
+    explicit IoUring(asio::io_service &io_service) : io_service_(io_service), event_(io_service) {}
+
+    bool setup(unsigned entries, size_t connections, std::string &error) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        params.cq_entries = static_cast<unsigned>(std::min<size_t>(
+                std::max<size_t>(connections * kCompletionsPerConnection + kBufferCount, 2 * entries), UINT32_MAX));
+        fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) {
+            error = fmt::format("io_uring_setup: {}", std::strerror(errno));
+            return false;
+        }
+
+        sqEntries_ = params.sq_entries;
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+            sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        }
+
+        sqRing_ = map(sqRingSize_, IORING_OFF_SQ_RING);
+        cqRing_ = single ? sqRing_ : map(cqRingSize_, IORING_OFF_CQ_RING);
+        sqes_ = static_cast<io_uring_sqe *>(map(sqEntries_ * sizeof(io_uring_sqe), IORING_OFF_SQES));
+        if (sqRing_ == nullptr || cqRing_ == nullptr || sqes_ == nullptr) {
+            error = fmt::format("io_uring mmap: {}", std::strerror(errno));
+            return false;
+        }
+
+        char *sq = static_cast<char *>(sqRing_);
+        char *cq = static_cast<char *>(cqRing_);
+        sqHead_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        sqFlags_ = reinterpret_cast<unsigned *>(sq + params.sq_off.flags);
+        sqMask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        sqeTail_ = submitted_ = *sqTail_;
+
+        int event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event < 0 || ::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_EVENTFD, &event, 1) < 0) {
+            error = fmt::format("io_uring eventfd: {}", std::strerror(errno));
+            if (event >= 0) {
+                ::close(event);
+            }
+            return false;
+        }
+        event_.assign(event);
+
+        bufferRing_ = static_cast<io_uring_buf *>(map(kBufferCount * sizeof(io_uring_buf), 0, true));
+        buffers_ = static_cast<char *>(map(kBufferCount * kBufferSize, 0, true));
+        if (bufferRing_ == nullptr || buffers_ == nullptr) {
+            error = fmt::format("io_uring buffers: {}", std::strerror(errno));
+            return false;
+        }
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(bufferRing_);
+        reg.ring_entries = kBufferCount;
+        reg.bgid = kBufferGroup;
+        if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            error = fmt::format("io_uring buffer ring: {}", std::strerror(errno));
+            return false;
+        }
+        for (uint16_t id = 0; id < kBufferCount; ++id) {
+            recycle(id);
+        }
+        return probe_multishot_receive(error);
+    }
+
+    // Buffer rings came in Linux 5.19 but multishot receives only in 6.0, and
+    // 5.19 fails every such receive with -EINVAL. A receive of one byte on a
+    // socketpair whose other end is closed tells the two apart: it completes
+    // with the byte and more set, then with end of stream.
+    bool probe_multishot_receive(std::string &error) {
+        int pair[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+            error = fmt::format("io_uring probe: {}", std::strerror(errno));
+            return false;
+        }
+        char byte = 0;
+        bool sent = ::send(pair[1], &byte, 1, MSG_NOSIGNAL) == 1;
+        ::close(pair[1]);
+        if (!sent) {
+            error = fmt::format("io_uring probe: {}", std::strerror(errno));
+            ::close(pair[0]);
+            return false;
+        }
+
+        io_uring_sqe *sqe = &sqes_[sqeTail_ & sqMask_];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = pair[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufferGroup;
+        sqArray_[sqeTail_ & sqMask_] = sqeTail_ & sqMask_;
+        ++sqeTail_;
+        __atomic_store_n(sqTail_, sqeTail_, __ATOMIC_RELEASE);
+
+        long result;
+        do {
+            result = ::syscall(__NR_io_uring_enter, fd_, 1, 0, 0, nullptr, 0);
+        } while (result < 0 && errno == EINTR);
+        if (result != 1) {
+            error = fmt::format("io_uring probe: {}", std::strerror(result < 0 ? errno : EAGAIN));
+            ::close(pair[0]);
+            return false;
+        }
+        submitted_ = sqeTail_;
+
+        bool supported = false;
+        bool first = true;
+        bool more = true;
+        while (more) {
+            unsigned head = *cqHead_;
+            if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+                result = ::syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (result < 0 && errno != EINTR) {
+                    error = fmt::format("io_uring probe: {}", std::strerror(errno));
+                    ::close(pair[0]);
+                    return false;
+                }
+                continue;
+            }
+
+            io_uring_cqe cqe = cqes_[head & cqMask_];
+            __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+            more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+            if (first) {
+                supported = cqe.res == 1 && more;
+                first = false;
+            }
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                recycle(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+        }
+        ::close(pair[0]);
+
+        // The probe's completions signalled the eventfd; nothing waits on it yet.
+        uint64_t count;
+        ssize_t ignored = ::read(event_.native_handle(), &count, sizeof(count));
+        (void) ignored;
+
+        if (!supported) {
+            error = "multishot receive unsupported, needs Linux 6.0";
+            return false;
+        }
+        return true;
+    }
+
+    void *map(size_t size, off_t offset, bool anonymous = false) {
+        void *address = anonymous
+                        ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                        : ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    // Returns a buffer to the ring. The ring's tail shares its first entry's
+    // reserved field.
+    void recycle(uint16_t id) {
+        io_uring_buf &buffer = bufferRing_[bufferTail_ & (kBufferCount - 1)];
+        buffer.addr = reinterpret_cast<uint64_t>(buffers_ + id * kBufferSize);
+        buffer.len = kBufferSize;
+        buffer.bid = id;
+        ++bufferTail_;
+        __atomic_store_n(&bufferRing_[0].resv, bufferTail_, __ATOMIC_RELEASE);
+    }
+
+    bool ring_full() const {
+        return sqeTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_;
+    }
+
+    // Entries go into the ring while it has room; a slot the kernel has not
+    // taken yet is never reused, so the rest wait in backlog_.
+    io_uring_sqe *get_sqe() {
+        if (backlog_.empty() && ring_full()) {
+            submit();
+        }
+
+        io_uring_sqe *sqe;
+        if (backlog_.empty() && !ring_full()) {
+            sqe = &sqes_[sqeTail_ & sqMask_];
+            sqArray_[sqeTail_ & sqMask_] = sqeTail_ & sqMask_;
+            ++sqeTail_;
+        } else {
+            backlog_.emplace_back();
+            sqe = &backlog_.back();
+        }
+        std::memset(sqe, 0, sizeof(*sqe));
+        schedule_submit(false);
+        return sqe;
+    }
+
+    // Submits once the current handler returns, after taking in completions
+    // first if the kernel asked for that.
+    void schedule_submit(bool reapFirst) {
+        if (submitScheduled_) {
+            return;
+        }
+        submitScheduled_ = true;
+        asio::post(io_service_, [this, reapFirst]() {
+            submitScheduled_ = false;
+            if (reapFirst) {
+                reap();
+            }
+            submit();
+        });
+    }
+
+    uint64_t add(io_uring_sqe *sqe, Handler handler) {
+        uint64_t id = nextId_++;
+        sqe->user_data = id;
+        ops_.emplace(id, std::make_shared<Handler>(std::move(handler)));
+        wait();
+        return id;
+    }
+
+    void submit() {
+        for (;;) {
+            while (!backlog_.empty() && !ring_full()) {
+                sqes_[sqeTail_ & sqMask_] = backlog_.front();
+                sqArray_[sqeTail_ & sqMask_] = sqeTail_ & sqMask_;
+                ++sqeTail_;
+                backlog_.pop_front();
+            }
+
+            // A linked entry goes in together with the one after it.
+            unsigned end = sqeTail_;
+            if (!backlog_.empty() && end != submitted_ && (sqes_[(end - 1) & sqMask_].flags & IOSQE_IO_LINK)) {
+                --end;
+            }
+            if (end == submitted_) {
+                return;
+            }
+
+            __atomic_store_n(sqTail_, end, __ATOMIC_RELEASE);
+            long result = ::syscall(__NR_io_uring_enter, fd_, end - submitted_, 0, 0, nullptr, 0);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EBUSY) {
+                    // Out of resources or completions: retry once some are taken in.
+                    schedule_submit(true);
+                    return;
+                }
+                fail_unsubmitted(errno);
+                return;
+            }
+
+            submitted_ += static_cast<unsigned>(result);
+            if (result == 0 || (backlog_.empty() && submitted_ == sqeTail_)) {
+                return;
+            }
+        }
+    }
+
+    // Takes back every entry the kernel has not accepted and fails the
+    // operations they belong to with error.
+    void fail_unsubmitted(int error) {
+        std::vector<uint64_t> ids;
+        for (unsigned i = submitted_; i != sqeTail_; ++i) {
+            ids.push_back(sqes_[i & sqMask_].user_data);
+        }
+        for (const io_uring_sqe &sqe : backlog_) {
+            ids.push_back(sqe.user_data);
+        }
+        sqeTail_ = submitted_;
+        __atomic_store_n(sqTail_, submitted_, __ATOMIC_RELEASE);
+        backlog_.clear();
+
+        // Looked up when they run, as an earlier handler may cancel a later one.
+        for (uint64_t id : ids) {
+            asio::post(io_service_, [this, id, error]() {
+                auto it = ops_.find(id);
+                if (it == ops_.end()) {
+                    return;
+                }
+                std::shared_ptr<Handler> handler = it->second;
+                ops_.erase(it);
+                (*handler)(-error, false, nullptr);
+            });
+        }
+    }
+
+    // The eventfd is only watched while operations are outstanding, so an
+    // idle ring does not keep io_service::run() from returning.
+    void wait() {
+        if (waiting_ || ops_.empty()) {
+            return;
+        }
+
+        waiting_ = true;
+        event_.async_wait(asio::posix::stream_descriptor::wait_read, [this](const boost::system::error_code &ec) {
+            waiting_ = false;
+            if (ec) {
+                return;
+            }
+
+            uint64_t count;
+            ssize_t ignored = ::read(event_.native_handle(), &count, sizeof(count));
+            (void) ignored;
+            reap();
+            wait();
+        });
+    }
+
+    // Completions that did not fit in the queue are held by the kernel until
+    // an io_uring_enter asks for events, which also signals the eventfd.
+    void reap() {
+        unsigned head = *cqHead_;
+        for (;;) {
+            if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+                if (!(__atomic_load_n(sqFlags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) {
+                    return;
+                }
+                long result = ::syscall(__NR_io_uring_enter, fd_, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (result < 0 && errno != EINTR) {
+                    return;
+                }
+                continue;
+            }
+
+            io_uring_cqe cqe = cqes_[head & cqMask_];
+            __atomic_store_n(cqHead_, ++head, __ATOMIC_RELEASE);
+
+            const char *data = nullptr;
+            bool buffer = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+            uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (buffer) {
+                data = buffers_ + id * kBufferSize;
+            }
+
+            auto it = ops_.find(cqe.user_data);
+            if (it != ops_.end()) {
+                std::shared_ptr<Handler> handler = it->second;
+                bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+                if (!more) {
+                    ops_.erase(it);
+                }
+                (*handler)(cqe.res, more, data);
+            }
+
+            if (buffer) {
+                recycle(id);
+            }
+        }
+    }
+};
+
+// Hashed timer wheel for request timeouts. Scheduling and cancelling are
+// O(1) and allocation-free once warmed up, and a whole event loop shares a
+// single steady_timer that ticks only while timeouts are pending. Deadlines
+// are rounded up to the next tick, so a timeout never fires early.
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Identifies a scheduled timeout; 0 is never returned.
+    using Handle = uint64_t;
+
+    explicit TimerWheel(asio::io_service &io_service, Clock::duration tick = std::chrono::milliseconds(10),
+                        size_t slots = 1024)
+            : timer_(io_service), tick_(tick), start_(Clock::now()), slots_(slots, kNone) {}
+
+    Handle Schedule(Clock::duration delay, std::function<void()> callback) {
+        if (!ticking_) {
+            current_ = ticks(Clock::now());
+        }
+
+        uint64_t due = std::max(ticks_up(Clock::now() + delay), current_ + 1);
+        uint32_t index = allocate();
+        Entry &entry = entries_[index];
+        entry.due = due;
+        entry.callback = std::move(callback);
+        entry.state = Scheduled;
+        link(index);
+        ++active_;
+
+        if (!ticking_) {
+            ticking_ = true;
+            wait();
+        }
+        return static_cast<Handle>(entry.generation) << 32 | index;
+    }
+
+    // Ignores handles that have already fired or been cancelled.
+    void Cancel(Handle handle) {
+        uint32_t index = static_cast<uint32_t>(handle);
+        if (handle == 0 || index >= entries_.size() || entries_[index].generation != handle >> 32) {
+            return;
+        }
+
+        Entry &entry = entries_[index];
+        if (entry.state == Scheduled) {
+            unlink(index);
+            release(index);
+        } else if (entry.state == Firing) {
+            entry.state = Cancelled;
+        }
+    }
+
+private:
+    static const uint32_t kNone = UINT32_MAX;
+
+    enum State {
+        Free,
+        Scheduled,
+        // Due in the current tick; may still be cancelled by an earlier callback.
+        Firing,
+        Cancelled,
+    };
+
+    struct Entry {
+        uint64_t due = 0;
+        std::function<void()> callback;
+        uint32_t prev = kNone;
+        uint32_t next = kNone;
+        uint32_t generation = 1;
+        State state = Free;
+    };
+
+    asio::steady_timer timer_;
+    const Clock::duration tick_;
+    const Clock::time_point start_;
+    std::vector<uint32_t> slots_;
+    std::vector<Entry> entries_;
+    std::vector<uint32_t> free_;
+    std::vector<uint32_t> firing_;
+    uint64_t current_ = 0;
+    size_t active_ = 0;
+    bool ticking_ = false;
+
+    uint64_t ticks(Clock::time_point time) const {
+        return static_cast<uint64_t>((time - start_) / tick_);
+    }
+
+    uint64_t ticks_up(Clock::time_point time) const {
+        return static_cast<uint64_t>((time - start_ + tick_ - Clock::duration(1)) / tick_);
+    }
+
+    uint32_t allocate() {
+        if (free_.empty()) {
+            entries_.emplace_back();
+            return static_cast<uint32_t>(entries_.size() - 1);
+        }
+        uint32_t index = free_.back();
+        free_.pop_back();
+        return index;
+    }
+
+    void release(uint32_t index) {
+        Entry &entry = entries_[index];
+        entry.callback = nullptr;
+        entry.state = Free;
+        ++entry.generation;
+        free_.push_back(index);
+        --active_;
+    }
+
+    void link(uint32_t index) {
+        Entry &entry = entries_[index];
+        uint32_t &head = slots_[entry.due % slots_.size()];
+        entry.prev = kNone;
+        entry.next = head;
+        if (head != kNone) {
+            entries_[head].prev = index;
+        }
+        head = index;
+    }
+
+    void unlink(uint32_t index) {
+        Entry &entry = entries_[index];
+        if (entry.prev != kNone) {
+            entries_[entry.prev].next = entry.next;
+        } else {
+            slots_[entry.due % slots_.size()] = entry.next;
+        }
+        if (entry.next != kNone) {
+            entries_[entry.next].prev = entry.prev;
+        }
+    }
+
+    void wait() {
+        timer_.expires_at(start_ + tick_ * static_cast<Clock::rep>(current_ + 1));
+        timer_.async_wait([this](const boost::system::error_code &ec) {
+            if (!ec) {
+                advance();
+            }
+        });
+    }
+
+    // Fires everything due up to now. Due entries are taken off the wheel
+    // first, so callbacks can freely schedule and cancel other timeouts.
+    void advance() {
+        uint64_t now = ticks(Clock::now());
+        while (current_ < now && active_ != 0) {
+            ++current_;
+
+            uint32_t index = slots_[current_ % slots_.size()];
+            while (index != kNone) {
+                uint32_t next = entries_[index].next;
+                if (entries_[index].due <= current_) {
+                    unlink(index);
+                    entries_[index].state = Firing;
+                    firing_.push_back(index);
+                }
+                index = next;
+            }
+
+            // advance() never runs from a callback, so firing_ is stable here.
+            for (uint32_t due : firing_) {
+                std::function<void()> callback;
+                if (entries_[due].state == Firing) {
+                    callback.swap(entries_[due].callback);
+                }
+                release(due);
+                if (callback) {
+                    callback();
+                }
+            }
+            firing_.clear();
+        }
+
+        if (active_ == 0) {
+            ticking_ = false;
+            return;
+        }
+        wait();
+    }
+};
+
+const uint32_t TimerWheel::kNone;
+
+// Limits on a single request; a zero duration disables that limit.
+struct Timeouts {
+    // Establishing a new connection.
+    std::chrono::steady_clock::duration connect{};
+    // From the connection being ready until the first response byte.
+    std::chrono::steady_clock::duration firstByte{};
+    // Between two reads once the response has started.
+    std::chrono::steady_clock::duration idle{};
+    // The whole request, from Start() until it completes.
+    std::chrono::steady_clock::duration total{};
+};
+
+// Outcome of a single request as reported to whoever started it.
+// Phase times are offsets from the start of the request; phases that were
+// skipped (lookup and connect on a reused connection) take no time.
+struct HttpResult {
+    int status = 0;
+    size_t bodySize = 0;
+    std::string error;
+    std::chrono::steady_clock::duration resolved{};
+    std::chrono::steady_clock::duration connected{};
+    std::chrono::steady_clock::duration sent{};
+    std::chrono::steady_clock::duration firstByte{};
+    std::chrono::steady_clock::duration elapsed{};
+};
+
+// The request line and header fields of an HTTP/1.1 request, rendered once
+// around the request target. Sending a request gathers the rendered parts
+// with the path and body in place, so nothing is formatted or copied per send.
+class RequestTemplate {
+public:
+    // Buffers of a request: the rendered head around path, then body.
+    using Buffers = std::array<asio::const_buffer, 4>;
+
+    RequestTemplate(const std::string &method, const HeaderFields &fields, size_t bodySize) {
+        start_ = method + " ";
+
+        rest_ = " HTTP/1.1\r\n";
+        for (const HeaderFields::Field field : fields) {
+            rest_.append(field.name.data(), field.name.size());
+            rest_ += ": ";
+            rest_.append(field.value.data(), field.value.size());
+            rest_ += "\r\n";
+        }
+        if (method == "POST") {
+            rest_ += "Content-Length: ";
+            rest_ += std::to_string(bodySize);
+            rest_ += "\r\n";
+        }
+        rest_ += "\r\n";
+    }
+
+    // path and body must stay alive until the buffers are sent.
+    Buffers Gather(const std::string &path, const std::string &body) const {
+        return Buffers{{asio::buffer(start_), asio::buffer(path), asio::buffer(rest_), asio::buffer(body)}};
+    }
+
+    // Appends a copy of a bodiless request for path, for batching pipelined requests.
+    void AppendTo(std::string &out, const std::string &path) const {
+        out += start_;
+        out += path;
+        out += rest_;
+    }
+
+private:
+    std::string start_;
+    std::string rest_;
+};
+
+class HttpClient {
+    static const size_t kReadSize = 16 * 1024;
+
+    std::string method_;
+    std::string body_;
+
+    const std::string host_;
+    const std::string port_;
+    std::string path_;
+
+    asio::io_service &io_service_;
+    DnsCache &dns_;
+    ConnectionPool &pool_;
+    asio::ip::tcp::socket sock_;
+    Connector connector_;
+    // The endpoint the current request is counted against in the pool.
+    asio::ip::tcp::endpoint endpoint_;
+    bool counted_ = false;
+    bool resolving_ = false;
+    bool connecting_ = false;
+
+    // The request's total deadline and the limit on its current phase:
+    // connecting, waiting for the first byte or waiting between reads.
+    TimerWheel *wheel_ = nullptr;
+    Timeouts timeouts_;
+    TimerWheel::Handle totalTimer_ = 0;
+    TimerWheel::Handle phaseTimer_ = 0;
+    // Set once the request in flight is aborted, by a timeout or Abort().
+    std::string abortError_;
+    bool active_ = false;
+
+    // io_uring state: the addresses tried in turn, the connect, multishot
+    // receive and send in flight, the iovecs still to send, bytes appended to
+    // response_ that no read has reported yet, how the receive ended, and the
+    // read waiting for data.
+    IoUring *uring_ = nullptr;
+    std::vector<asio::ip::tcp::endpoint> endpoints_;
+    asio::steady_timer connectTimer_;
+    uint64_t connectId_ = 0;
+    uint64_t receiveId_ = 0;
+    uint64_t sendId_ = 0;
+    std::array<iovec, 5> sendIov_;
+    size_t sendFirst_ = 0;
+    size_t sendCount_ = 0;
+    size_t sendSize_ = 0;
+    msghdr sendMessage_;
+    size_t received_ = 0;
+    boost::system::error_code receiveEnd_;
+    std::function<void(const boost::system::error_code &)> reader_;
+
+    // Without a sink, body bytes after those already in response_ are counted
+    // and dropped as they arrive: read into scratch_ through asio, or skipped
+    // in uring's receive buffers up to dropLimit_. dropped_ is the count not
+    // yet reported.
+    std::unique_ptr<char[]> scratch_;
+    uint64_t dropLimit_ = 0;
+    size_t dropped_ = 0;
+
+    // Pipe that identity bodies are spliced through from the socket into a
+    // file sink, created on first use; spliceSize_ is its capacity.
+    // spliceOff_ is set once splicing has failed and should not be retried.
+    int pipe_[2] = {-1, -1};
+    size_t spliceSize_ = 0;
+    bool spliceOff_ = false;
+
+    // Set once the connection has served a response before the current one.
+    bool reused_ = false;
+    bool keepAlive_ = false;
+    bool verbose_ = true;
+    BodySink *sink_ = nullptr;
+    bool sinkFailed_ = false;
+
+    // Requests after the current one, of which the first written_ have already
+    // been sent on the connection. connection_ changes whenever the connection
+    // is closed, so a write still completing on an old one is ignored.
+    struct Queued {
+        std::string path;
+        std::chrono::steady_clock::time_point sent;
+    };
+    std::deque<Queued> queued_;
+    size_t written_ = 0;
+    size_t depth_ = 1;
+    bool writing_ = false;
+    unsigned connection_ = 0;
+
+    // Rendered once and replaced whenever a header changes. The current
+    // request is sent from its buffers, followed by request_ holding any
+    // pipelined requests sent along with it.
+    std::unique_ptr<RequestTemplate> template_;
+    std::array<asio::const_buffer, 5> sendBuffers_;
+    std::string request_;
+    asio::streambuf response_;
+    HttpResponseParser parser_;
+    ChunkedDecoder chunked_;
+    // Chained after chunked_ for gzip or deflate bodies; decodeFailed_ is set
+    // once their data turned out to be corrupt.
+    ContentDecoder content_;
+    bool decodeFailed_ = false;
+    // Whether bodies written to a sink may be coded; see SetDecoding().
+    bool decode_ = true;
+    // Body bytes still expected after the head, or npos when the body is
+    // chunked or runs until the server closes the connection.
+    size_t bodyLength_ = 0;
+    uint64_t bodyLimit_ = UINT64_MAX;
+
+    HttpResult result_;
+    std::chrono::steady_clock::time_point started_;
+    std::function<void()> onDone_;
+    std::function<bool(const HttpResponseParser &)> onHeaders_;
+
+public:
+    HttpClient(asio::io_service &io_service, DnsCache &dns, ConnectionPool &pool,
+               std::string host, std::string port, std::string path, std::string body, std::string method)
+            : method_(std::move(method)), body_(std::move(body)), host_(std::move(host)), port_(std::move(port)),
+              path_(std::move(path)), io_service_(io_service), dns_(dns), pool_(pool), sock_(io_service),
+              connector_(io_service, pool), connectTimer_(io_service),
+              response_(HttpResponseParser::kMaxHeadSize + kReadSize) {
+        requestFields_.Add("Host", Url::FormatAuthority(host_, port_));
+        requestFields_.Add("User-Agent", "mycurl/1.0");
+    }
+
+    ~HttpClient() {
+        cancel_timeouts();
+        stop_uring();
+        if (pipe_[0] >= 0) {
+            ::close(pipe_[0]);
+            ::close(pipe_[1]);
+        }
+    }
+
+    // Called once the request has completed or failed; see Result(). With
+    // queued requests it is called for each of them in turn, and the client
+    // must outlive them all; see Pending().
+    void OnDone(std::function<void()> handler) {
+        onDone_ = std::move(handler);
+    }
+
+    // Called with the final response head before the body is read. Returning
+    // false fails the request without reading the body.
+    void OnHeaders(std::function<bool(const HttpResponseParser &)> handler) {
+        onHeaders_ = std::move(handler);
+    }
+
+    // Adds or replaces a request header; an empty value removes it.
+    void SetHeader(const std::string &name, const std::string &value) {
+        if (value.empty()) {
+            requestFields_.Remove(name);
+        } else {
+            requestFields_.Set(name, value);
+        }
+        template_.reset();
+    }
+
+    // Stops reading a length-delimited body once bytes of it have been
+    // received, leaving the rest unread and closing the connection. May be
+    // called while the request is in flight.
+    void LimitBody(uint64_t bytes) {
+        bodyLimit_ = bytes;
+    }
+
+    // Queues another request for path on the same host, sent after the
+    // current one on the same connection whenever it is kept alive.
+    void Enqueue(std::string path) {
+        queued_.push_back({std::move(path), {}});
+    }
+
+    // Requests queued behind the current one.
+    size_t Pending() const {
+        return queued_.size();
+    }
+
+    // Sends up to depth requests back-to-back without waiting for their
+    // responses, which are read in order. Requests other than GET and HEAD
+    // are never pipelined.
+    void SetPipelineDepth(size_t depth) {
+        depth_ = std::max<size_t>(depth, 1);
+    }
+
+    // Progress, headers and errors are printed unless disabled.
+    void SetVerbose(bool verbose) {
+        verbose_ = verbose;
+        connector_.SetVerbose(verbose);
+    }
+
+    // Fails requests that exceed the given limits, timed on wheel.
+    void SetTimeouts(TimerWheel &wheel, const Timeouts &timeouts) {
+        wheel_ = &wheel;
+        timeouts_ = timeouts;
+    }
+
+    // Socket I/O goes through uring instead of asio's reactor when set. Such
+    // connections try their addresses in turn rather than racing them.
+    void SetUring(IoUring *uring) {
+        uring_ = uring;
+    }
+
+    // Response bodies are streamed to sink; without one they are read and dropped.
+    void SetSink(BodySink *sink) {
+        if ((sink_ != nullptr) != (sink != nullptr)) {
+            template_.reset();
+        }
+        sink_ = sink;
+    }
+
+    // Gzip and deflate bodies are asked for with Accept-Encoding and decoded
+    // only when set (the default) and there is a sink to decode them into, so
+    // bodies that are dropped or counted are measured as the server's
+    // uncoded representation.
+    void SetDecoding(bool decode) {
+        decode_ = decode;
+        template_.reset();
+    }
+
+    const HttpResult &Result() const {
+        return result_;
+    }
+
+    std::string GetHost() const {
+        return host_;
+    }
+
+    std::string GetPath() const {
+        return path_;
+    }
+
+    void Start() {
+        result_ = HttpResult();
+        sinkFailed_ = false;
+        decodeFailed_ = false;
+        bodyLimit_ = UINT64_MAX;
+        started_ = std::chrono::steady_clock::now();
+        keepAlive_ = false;
+        written_ = 0;
+        active_ = true;
+        arm_timeouts();
+        start_connection();
+    }
+
+    // Fails the request in flight, if there is one, with error.
+    void Abort(const std::string &error) {
+        if (active_ && abortError_.empty()) {
+            abort(error);
+        }
+    }
+
+private:
+    HeaderFields requestFields_;
+
+    void start_connection() {
+        reused_ = pool_.Acquire(host_, port_, sock_);
+        if (reused_) {
+            boost::system::error_code ec;
+            endpoint_ = sock_.remote_endpoint(ec);
+            result_.resolved = result_.connected = since_start();
+            if (verbose_) {
+                LOG_DEBUG("{}: reusing connection to {}:{}\n", host_,
+                          endpoint_.address().to_string(), endpoint_.port());
+            }
+            begin_request();
+            do_send_http();
+            return;
+        }
+
+        do_resolve();
+    }
+
+    // Makes the first queued request the current one, reading its response
+    // if it was already sent on the connection.
+    void next_request() {
+        Queued next = std::move(queued_.front());
+        queued_.pop_front();
+
+        path_ = std::move(next.path);
+        result_ = HttpResult();
+        sinkFailed_ = false;
+        decodeFailed_ = false;
+        bodyLimit_ = UINT64_MAX;
+        keepAlive_ = false;
+        active_ = true;
+        arm_timeouts();
+
+        if (!sock_.is_open()) {
+            started_ = std::chrono::steady_clock::now();
+            written_ = 0;
+            start_connection();
+            return;
+        }
+
+        reused_ = true;
+        begin_request();
+        if (written_ == 0) {
+            started_ = std::chrono::steady_clock::now();
+            do_send_http();
+            return;
+        }
+
+        --written_;
+        started_ = next.sent;
+        send_queued();
+        do_recv_http_header();
+    }
+
+    void do_resolve() {
+        resolving_ = true;
+        dns_.Resolve(
+                host_, port_,
+                [this](const boost::system::error_code &ec, const DnsCache::Endpoints &endpoints) {
+                    resolving_ = false;
+                    if (!abortError_.empty()) {
+                        fail(abortError_);
+                        return;
+                    }
+                    if (ec) {
+                        fail(fmt::format("Error resolving {}: {}", host_, ec.message()));
+                        return;
+                    }
+                    result_.resolved = since_start();
+
+                    std::vector<asio::ip::tcp::endpoint> ordered = pool_.Order(host_, port_, *endpoints);
+                    if (verbose_) {
+                        LOG_DEBUG("{}: resolved to {} address(es), trying {}:{} first\n", host_, ordered.size(),
+                                  ordered.front().address().to_string(), ordered.front().port());
+                    }
+                    arm_phase(timeouts_.connect, "Connect");
+                    if (uring_ != nullptr) {
+                        endpoints_ = std::move(ordered);
+                        uring_connect(0);
+                        return;
+                    }
+                    do_connect(std::move(ordered));
+                });
+    }
+
+    void begin_request() {
+        pool_.BeginRequest(endpoint_);
+        counted_ = true;
+        arm_phase(timeouts_.firstByte, "First byte");
+    }
+
+    void arm_timeouts() {
+        cancel_timeouts();
+        abortError_.clear();
+        if (wheel_ != nullptr && timeouts_.total != std::chrono::steady_clock::duration::zero()) {
+            totalTimer_ = wheel_->Schedule(timeouts_.total, [this]() {
+                totalTimer_ = 0;
+                expire("Total");
+            });
+        }
+    }
+
+    // Replaces the limit on the current phase.
+    void arm_phase(std::chrono::steady_clock::duration limit, const char *phase) {
+        if (wheel_ == nullptr) {
+            return;
+        }
+        wheel_->Cancel(phaseTimer_);
+        phaseTimer_ = 0;
+        if (limit != std::chrono::steady_clock::duration::zero()) {
+            phaseTimer_ = wheel_->Schedule(limit, [this, phase]() {
+                phaseTimer_ = 0;
+                expire(phase);
+            });
+        }
+    }
+
+    void cancel_timeouts() {
+        if (wheel_ != nullptr) {
+            wheel_->Cancel(totalTimer_);
+            wheel_->Cancel(phaseTimer_);
+        }
+        totalTimer_ = 0;
+        phaseTimer_ = 0;
+    }
+
+    void expire(const char *phase) {
+        abort(fmt::format("{} timeout for {}", phase, host_));
+    }
+
+    // Aborts whatever the request is waiting on, so that operation fails it
+    // with error. A lookup in progress is left to finish.
+    void abort(std::string error) {
+        abortError_ = std::move(error);
+        if (resolving_) {
+            return;
+        }
+        if (uring_ != nullptr) {
+            // Closing the connection drops the uring handlers.
+            fail(abortError_);
+            return;
+        }
+        if (connecting_) {
+            connector_.Cancel();
+            return;
+        }
+        boost::system::error_code ignored;
+        sock_.cancel(ignored);
+    }
+
+    // A pooled connection may have been closed by the server while idle; such a
+    // request is retried once on a fresh connection before anything is received.
+    bool retry_fresh(const boost::system::error_code &ec) {
+        if (!reused_ || response_.size() != 0 ||
+            (ec != asio::error::eof && ec != asio::error::connection_reset && ec != asio::error::broken_pipe)) {
+            return false;
+        }
+
+        if (verbose_) {
+            LOG_WARN("{}: pooled connection lost ({}), reconnecting\n", host_, ec.message());
+        }
+        close_connection();
+        reused_ = false;
+        if (counted_) {
+            pool_.EndRequest(endpoint_);
+            counted_ = false;
+        }
+        do_resolve();
+        return true;
+    }
+
+    void close_connection() {
+        stop_uring();
+        boost::system::error_code ignored;
+        sock_.close(ignored);
+        response_.consume(response_.size());
+        ++connection_;
+        written_ = 0;
+        writing_ = false;
+    }
+
+    // Keeps the connection for queued requests; otherwise it goes back to the
+    // pool when nothing more is expected on it.
+    void release_connection() {
+        if (!keepAlive_) {
+            close_connection();
+        } else if (queued_.empty()) {
+            stop_uring();
+            if (response_.size() == 0) {
+                pool_.Release(host_, port_, std::move(sock_));
+                ++connection_;
+            } else {
+                close_connection();
+            }
+        }
+    }
+
+    std::chrono::steady_clock::duration since_start() const {
+        return std::chrono::steady_clock::now() - started_;
+    }
+
+    void finish() {
+        cancel_timeouts();
+        if (counted_) {
+            pool_.EndRequest(endpoint_);
+            counted_ = false;
+        }
+        result_.elapsed = since_start();
+        active_ = false;
+
+        // The handler may destroy the client once nothing is pending.
+        bool more = !queued_.empty();
+        if (onDone_) {
+            onDone_();
+        }
+        if (more) {
+            next_request();
+        }
+    }
+
+    void fail(std::string error) {
+        if (!abortError_.empty()) {
+            error = abortError_;
+        }
+        if (verbose_) {
+            LOG_WARN("{}\n", error);
+        }
+        result_.error = std::move(error);
+        keepAlive_ = false;
+        release_connection();
+        finish();
+    }
+
+    void do_connect(std::vector<asio::ip::tcp::endpoint> endpoints) {
+        connecting_ = true;
+        connector_.Connect(
+                host_, std::move(endpoints), sock_,
+                [this](const boost::system::error_code &ec, const asio::ip::tcp::endpoint &dest) {
+                    connecting_ = false;
+                    if (ec) {
+                        fail(fmt::format("Error connecting to {}: {}", host_, ec.message()));
+                        return;
+                    }
+
+                    endpoint_ = dest;
+                    result_.connected = since_start();
+                    if (verbose_) {
+                        LOG_DEBUG("{}: connected to {}:{}\n", host_, dest.address().to_string(), dest.port());
+                    }
+
+                    begin_request();
+                    do_send_http();
+                });
+    }
+
+    size_t pipeline_depth() const {
+        return method_ == "GET" || method_ == "HEAD" ? depth_ : 1;
+    }
+
+    const RequestTemplate &request_template() {
+        if (!template_) {
+            if (sink_ != nullptr && decode_) {
+                requestFields_.Set("Accept-Encoding", "gzip, deflate");
+            } else {
+                requestFields_.Remove("Accept-Encoding");
+            }
+            template_.reset(new RequestTemplate(method_, requestFields_, body_.size()));
+        }
+        return *template_;
+    }
+
+    // Appends queued requests to request_ until depth requests, counting the
+    // current one, are outstanding on the connection.
+    size_t append_queued() {
+        size_t count = std::min(queued_.size(), pipeline_depth() - 1);
+        auto now = std::chrono::steady_clock::now();
+        size_t appended = 0;
+        for (; written_ < count; ++written_, ++appended) {
+            request_template().AppendTo(request_, queued_[written_].path);
+            queued_[written_].sent = now;
+        }
+        return appended;
+    }
+
+    // Tops up the pipeline while the current response is being read.
+    void send_queued() {
+        if (writing_) {
+            return;
+        }
+
+        request_.clear();
+        size_t appended = append_queued();
+        if (appended == 0) {
+            return;
+        }
+        sendBuffers_ = {{asio::buffer(request_)}};
+
+        writing_ = true;
+        const unsigned connection = connection_;
+        write_request(
+                [this, connection, appended](const boost::system::error_code &ec, std::size_t size) {
+                    if (connection != connection_) {
+                        return;
+                    }
+                    writing_ = false;
+
+                    // A broken connection also fails the read of the current response.
+                    if (ec) {
+                        return;
+                    }
+
+                    if (verbose_) {
+                        LOG_DEBUG("{}: sent {} bytes for {} pipelined request(s)\n", host_, size, appended);
+                    }
+                    send_queued();
+                }
+        );
+    }
+
+    void prepare_request() {
+        static const std::string noBody;
+        RequestTemplate::Buffers buffers = request_template().Gather(path_, method_ == "POST" ? body_ : noBody);
+        request_.clear();
+        append_queued();
+
+        std::copy(buffers.begin(), buffers.end(), sendBuffers_.begin());
+        sendBuffers_.back() = asio::buffer(request_);
+    }
+
+    void do_send_http() {
+        prepare_request();
+        write_request(std::bind(&HttpClient::handle_request_sent, this, _1, _2));
+    }
+
+    void handle_request_sent(const boost::system::error_code &ec, std::size_t size) {
+        if (ec) {
+            if (retry_fresh(ec)) {
+                return;
+            }
+            fail(fmt::format("Error sending {}: {}: {}", method_, ec.category().name(), ec.value()));
+            return;
+        }
+
+        result_.sent = since_start();
+        if (verbose_) {
+            LOG_DEBUG("{}: sent {} bytes\n", host_, size);
+        }
+
+        do_recv_http_header();
+    }
+
+    // Sends all of sendBuffers_ with one gather write.
+    template <typename Handler>
+    void write_request(Handler handler) {
+        if (uring_ == nullptr) {
+            asio::async_write(sock_, sendBuffers_, handler);
+            return;
+        }
+
+        sendCount_ = 0;
+        sendSize_ = 0;
+        for (const auto &buffer : sendBuffers_) {
+            if (buffer.size() != 0) {
+                sendIov_[sendCount_++] = {const_cast<void *>(buffer.data()), buffer.size()};
+                sendSize_ += buffer.size();
+            }
+        }
+        sendFirst_ = 0;
+        uring_send(handler);
+    }
+
+    // Reads more of the response into response_, at most size bytes through
+    // asio. Through io_uring the multishot receive appends whatever arrives,
+    // so this may complete at once with data that came in earlier.
+    template <typename Handler>
+    void read_some(size_t size, Handler handler) {
+        if (uring_ == nullptr) {
+            sock_.async_read_some(
+                    response_.prepare(size),
+                    [this, handler](const boost::system::error_code &ec, std::size_t received) {
+                        response_.commit(received);
+                        if (!ec) {
+                            arm_phase(timeouts_.idle, "Idle");
+                        }
+                        handler(ec);
+                    });
+            return;
+        }
+
+        reader_ = handler;
+        if (receiveId_ == 0 && !receiveEnd_) {
+            start_receiving();
+        }
+        deliver_received();
+    }
+
+    // Connects to each address in turn, with the request linked behind the
+    // connect so both reach the kernel in one submission. An address that has
+    // not answered within the attempt delay is given up for the next one.
+    void uring_connect(size_t index) {
+        const asio::ip::tcp::endpoint &dest = endpoints_[index];
+        boost::system::error_code ec;
+        sock_.open(dest.protocol(), ec);
+        if (ec) {
+            fail(fmt::format("Error connecting to {}: {}", host_, ec.message()));
+            return;
+        }
+
+        prepare_request();
+        connectId_ = uring_->Connect(
+                sock_.native_handle(), dest.data(), static_cast<socklen_t>(dest.size()), true,
+                [this, index](int result, bool, const char *) {
+                    connectId_ = 0;
+                    connectTimer_.cancel();
+                    const asio::ip::tcp::endpoint &dest = endpoints_[index];
+                    if (result < 0) {
+                        boost::system::error_code ec(-result, boost::system::system_category());
+                        if (verbose_) {
+                            LOG_WARN("{}: connecting to {}:{} failed: {}\n",
+                                     host_, dest.address().to_string(), dest.port(), ec.message());
+                        }
+                        close_connection();
+                        if (index + 1 < endpoints_.size()) {
+                            uring_connect(index + 1);
+                        } else {
+                            fail(fmt::format("Error connecting to {}: {}", host_, ec.message()));
+                        }
+                        return;
+                    }
+
+                    endpoint_ = dest;
+                    result_.connected = since_start();
+                    if (verbose_) {
+                        LOG_DEBUG("{}: connected to {}:{}\n", host_, dest.address().to_string(), dest.port());
+                    }
+                    begin_request();
+                });
+        write_request(std::bind(&HttpClient::handle_request_sent, this, _1, _2));
+
+        if (index + 1 < endpoints_.size()) {
+            // The delay may have expired with its handler queued by the time
+            // the connection is torn down, so the handler checks it is still
+            // for the same connection.
+            const unsigned connection = connection_;
+            connectTimer_.expires_after(pool_.AttemptDelay());
+            connectTimer_.async_wait([this, index, connection](const boost::system::error_code &ec) {
+                if (ec || connection != connection_ || connectId_ == 0) {
+                    return;
+                }
+                if (verbose_) {
+                    const asio::ip::tcp::endpoint &dest = endpoints_[index];
+                    LOG_WARN("{}: connecting to {}:{} timed out\n",
+                             host_, dest.address().to_string(), dest.port());
+                }
+                close_connection();
+                uring_connect(index + 1);
+            });
+        }
+    }
+
+    // Sends what is left of sendIov_, resuming after partial sends.
+    void uring_send(std::function<void(const boost::system::error_code &, std::size_t)> handler) {
+        sendMessage_ = msghdr();
+        sendMessage_.msg_iov = sendIov_.data() + sendFirst_;
+        sendMessage_.msg_iovlen = sendCount_ - sendFirst_;
+        sendId_ = uring_->SendMsg(
+                sock_.native_handle(), &sendMessage_,
+                [this, handler](int result, bool, const char *) {
+                    sendId_ = 0;
+                    if (result < 0) {
+                        handler(boost::system::error_code(-result, boost::system::system_category()), 0);
+                        return;
+                    }
+
+                    size_t sent = static_cast<size_t>(result);
+                    while (sendFirst_ < sendCount_ && sent >= sendIov_[sendFirst_].iov_len) {
+                        sent -= sendIov_[sendFirst_++].iov_len;
+                    }
+                    if (sendFirst_ == sendCount_) {
+                        handler(boost::system::error_code(), sendSize_);
+                        return;
+                    }
+                    iovec &partial = sendIov_[sendFirst_];
+                    partial.iov_base = static_cast<char *>(partial.iov_base) + sent;
+                    partial.iov_len -= sent;
+                    uring_send(handler);
+                });
+    }
+
+    void start_receiving() {
+        receiveId_ = uring_->Receive(
+                sock_.native_handle(),
+                [this](int result, bool more, const char *data) {
+                    if (result > 0) {
+                        size_t size = static_cast<size_t>(result);
+                        size_t drop = static_cast<size_t>(std::min<uint64_t>(size, dropLimit_));
+                        dropLimit_ -= drop;
+                        dropped_ += drop;
+                        received_ += drop;
+                        size -= drop;
+                        if (response_.size() + size > response_.max_size()) {
+                            receiveEnd_ = asio::error::no_buffer_space;
+                        } else if (size != 0) {
+                            std::memcpy(response_.prepare(size).data(), data + drop, size);
+                            response_.commit(size);
+                            received_ += size;
+                        }
+                    } else if (result == 0) {
+                        receiveEnd_ = asio::error::eof;
+                    } else if (result != -ENOBUFS) {
+                        receiveEnd_ = boost::system::error_code(-result, boost::system::system_category());
+                    }
+
+                    // The receive also stops when the buffer ring runs dry.
+                    if (!more) {
+                        receiveId_ = 0;
+                        if (!receiveEnd_) {
+                            start_receiving();
+                        }
+                    }
+                    deliver_received();
+                });
+    }
+
+    void deliver_received() {
+        if (!reader_ || (received_ == 0 && !receiveEnd_)) {
+            return;
+        }
+
+        boost::system::error_code ec = received_ != 0 ? boost::system::error_code() : receiveEnd_;
+        received_ = 0;
+        if (!ec) {
+            arm_phase(timeouts_.idle, "Idle");
+        }
+        std::function<void(const boost::system::error_code &)> reader;
+        reader.swap(reader_);
+        reader(ec);
+    }
+
+    // Cancels the operations on the connection before it is closed or pooled.
+    void stop_uring() {
+        if (uring_ == nullptr) {
+            return;
+        }
+        connectTimer_.cancel();
+        if (connectId_ != 0) {
+            uring_->Cancel(connectId_);
+            connectId_ = 0;
+        }
+        if (receiveId_ != 0) {
+            uring_->Cancel(receiveId_);
+            receiveId_ = 0;
+        }
+        if (sendId_ != 0) {
+            uring_->Cancel(sendId_);
+            sendId_ = 0;
+        }
+        received_ = 0;
+        receiveEnd_ = boost::system::error_code();
+        reader_ = nullptr;
+        dropLimit_ = 0;
+        dropped_ = 0;
+    }
+
+    void do_recv_http_header() {
+        parser_.Reset();
+        if (response_.size() != 0) {
+            parse_http_header();
+            return;
+        }
+        read_http_header();
+    }
+
+    void read_http_header() {
+        read_some(
+                kReadSize,
+                [this](const boost::system::error_code &ec) {
+                    if (ec) {
+                        if (retry_fresh(ec)) {
+                            return;
+                        }
+                        fail(fmt::format("Error receiving header: {}: {}", ec.category().name(), ec.value()));
+                        return;
+                    }
+
+                    parse_http_header();
+                });
+    }
+
+    void parse_http_header() {
+        if (result_.firstByte == std::chrono::steady_clock::duration::zero()) {
+            result_.firstByte = since_start();
+        }
+        const char *data = static_cast<const char *>(response_.data().data());
+
+        switch (parser_.Parse(data, response_.size())) {
+            case HttpResponseParser::NeedMore:
+                read_http_header();
+                return;
+            case HttpResponseParser::Invalid:
+                fail(fmt::format("Invalid response header from {}", host_));
+                return;
+            case HttpResponseParser::Done:
+                break;
+        }
+
+        if (verbose_) {
+            LOG_DEBUG("{}: header length {}\n{}", host_, parser_.HeadSize(), parser_.Head());
+        }
+
+        int status = parser_.StatusCode();
+        result_.status = status;
+        response_.consume(parser_.HeadSize());
+
+        // Interim responses are followed by the real one on the same connection.
+        if (status >= 100 && status < 200 && status != 101) {
+            do_recv_http_header();
+            return;
+        }
+
+        keepAlive_ = parser_.KeepAlive();
+
+        if (onHeaders_ && !onHeaders_(parser_)) {
+            fail(fmt::format("Unexpected response {} from {}", status, host_));
+            return;
+        }
+
+        if (method_ == "HEAD" || status == 204 || status == 304) {
+            bodyLength_ = 0;
+            content_.Start(ContentDecoder::Identity);
+            do_receive_http_body();
+            return;
+        }
+
+        // Dropped bodies are only counted, and with decoding off bodies are kept
+        // as sent, so either is left coded if the server codes it anyway.
+        ContentDecoder::Coding coding = ContentDecoder::Identity;
+        if (sink_ != nullptr && decode_) {
+            coding = ContentDecoder::Parse(parser_.Find(KnownHeader::ContentEncoding));
+        }
+        if (!content_.Start(coding)) {
+            fail(fmt::format("Error setting up decoding of the body from {}", host_));
+            return;
+        }
+
+        if (parser_.IsChunked()) {
+            bodyLength_ = std::string::npos;
+            do_receive_http_chunked_body();
+            return;
+        }
+
+        if (parser_.HasContentLength()) {
+            bodyLength_ = parser_.ContentLength();
+        } else {
+            keepAlive_ = false;
+            bodyLength_ = std::string::npos;
+        }
+        do_receive_http_body();
+    }
+
+    // Writes whatever part of the body is buffered to the sink, then reads at
+    // most kReadSize more, never past the end of the body.
+    void do_receive_http_body() {
+        uint64_t allowed = bodyLimit_ - std::min<uint64_t>(bodyLimit_, result_.bodySize);
+        size_t size = static_cast<size_t>(std::min<uint64_t>(std::min(response_.size(), bodyLength_), allowed));
+        write_body(static_cast<const char *>(response_.data().data()), size);
+        response_.consume(size);
+
+        if (body_failed()) {
+            return;
+        }
+
+        if (bodyLength_ != std::string::npos) {
+            bodyLength_ -= size;
+            if (bodyLength_ == 0) {
+                complete_body();
+                return;
+            }
+        }
+
+        if (result_.bodySize >= bodyLimit_) {
+            keepAlive_ = false;
+            complete_body();
+            return;
+        }
+
+        if (sink_ == nullptr) {
+            drop_some(std::min<uint64_t>(bodyLength_, allowed - size));
+            return;
+        }
+        if (uring_ == nullptr && !spliceOff_ && !content_.Active() && open_pipe()) {
+            splice_body(std::min<uint64_t>(bodyLength_, allowed - size));
+            return;
+        }
+        read_some(std::min(bodyLength_, kReadSize), std::bind(&HttpClient::handle_http_body, this, _1));
+    }
+
+    // Reads and counts at most limit more bytes of the body without keeping
+    // them, then carries on with handle_http_body.
+    void drop_some(uint64_t limit) {
+        if (uring_ == nullptr) {
+            if (!scratch_) {
+                scratch_.reset(new char[kReadSize]);
+            }
+            sock_.async_read_some(
+                    asio::buffer(scratch_.get(), static_cast<size_t>(std::min<uint64_t>(limit, kReadSize))),
+                    [this](const boost::system::error_code &ec, std::size_t received) {
+                        dropped_ = received;
+                        if (!ec) {
+                            arm_phase(timeouts_.idle, "Idle");
+                        }
+                        handle_dropped_body(ec);
+                    });
+            return;
+        }
+
+        dropLimit_ = limit;
+        read_some(0, std::bind(&HttpClient::handle_dropped_body, this, _1));
+    }
+
+    bool open_pipe() {
+        if (pipe_[0] >= 0) {
+            return true;
+        }
+        boost::system::error_code ec;
+        if (::pipe2(pipe_, O_CLOEXEC | O_NONBLOCK) != 0 || (sock_.native_non_blocking(true, ec), ec)) {
+            spliceOff_ = true;
+            return false;
+        }
+        ::fcntl(pipe_[1], F_SETPIPE_SZ, 1024 * 1024);
+        int size = ::fcntl(pipe_[1], F_GETPIPE_SZ);
+        spliceSize_ = size > 0 ? static_cast<size_t>(size) : 64 * 1024;
+        return true;
+    }
+
+    // Once the socket is readable, moves at most limit bytes of the body from
+    // it into the sink's file through pipe_, then carries on with
+    // handle_http_body. Sinks that cannot be spliced into get the bytes
+    // through Write() instead.
+    void splice_body(uint64_t limit) {
+        sock_.async_wait(asio::socket_base::wait_read, [this, limit](const boost::system::error_code &ec) {
+            if (ec) {
+                handle_http_body(ec);
+                return;
+            }
+
+            int64_t offset = -1;
+            uint64_t sinkLimit = 0;
+            int fd = sink_->SpliceTo(offset, sinkLimit);
+            if (fd < 0 || sinkLimit == 0) {
+                spliceOff_ = fd < 0;
+                read_some(static_cast<size_t>(std::min<uint64_t>(limit, kReadSize)),
+                          std::bind(&HttpClient::handle_http_body, this, _1));
+                return;
+            }
+
+            size_t size = static_cast<size_t>(std::min<uint64_t>({limit, sinkLimit, spliceSize_}));
+            ssize_t moved = ::splice(sock_.native_handle(), nullptr, pipe_[1], nullptr, size,
+                                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    splice_body(limit);
+                } else {
+                    handle_http_body(boost::system::error_code(errno, boost::system::system_category()));
+                }
+                return;
+            }
+            if (moved == 0) {
+                handle_http_body(asio::error::eof);
+                return;
+            }
+
+            drain_pipe(fd, offset, static_cast<size_t>(moved));
+            result_.bodySize += moved;
+            if (bodyLength_ != std::string::npos) {
+                bodyLength_ -= moved;
+            }
+            arm_phase(timeouts_.idle, "Idle");
+            handle_http_body(boost::system::error_code());
+        });
+    }
+
+    // Moves size bytes from pipe_ into fd. If the file does not support
+    // splice(), they are read back and written through the sink, and splicing
+    // is not tried again.
+    void drain_pipe(int fd, int64_t offset, size_t size) {
+        loff_t position = offset;
+        while (size != 0 && !spliceOff_) {
+            ssize_t written = ::splice(pipe_[0], nullptr, fd, offset >= 0 ? &position : nullptr, size, SPLICE_F_MOVE);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                spliceOff_ = true;
+                break;
+            }
+            sink_->Spliced(static_cast<size_t>(written));
+            size -= written;
+        }
+
+        if (!scratch_ && size != 0) {
+            scratch_.reset(new char[kReadSize]);
+        }
+        while (size != 0 && !sinkFailed_) {
+            ssize_t got = ::read(pipe_[0], scratch_.get(), std::min(size, kReadSize));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                sinkFailed_ = true;
+                break;
+            }
+            sinkFailed_ = !sink_->Write(scratch_.get(), static_cast<size_t>(got));
+            size -= got;
+        }
+    }
+
+    void handle_dropped_body(const boost::system::error_code &ec) {
+        size_t size = dropped_;
+        dropped_ = 0;
+        dropLimit_ = 0;
+        result_.bodySize += size;
+        if (bodyLength_ != std::string::npos) {
+            bodyLength_ -= size;
+        }
+        handle_http_body(size != 0 ? boost::system::error_code() : ec);
+    }
+
+    void do_receive_http_chunked_body() {
+        chunked_.Reset();
+        if (verbose_) {
+            LOG_DEBUG("{}: chunked body\n", host_);
+        }
+        decode_http_chunked_body();
+    }
+
+    void read_http_chunked_body() {
+        read_some(
+                kReadSize,
+                [this](const boost::system::error_code &ec) {
+                    if (ec) {
+                        fail(fmt::format("Error receiving body: {}: {}", ec.category().name(), ec.value()));
+                        return;
+                    }
+
+                    decode_http_chunked_body();
+                });
+    }
+
+    // Passes every decoded slice straight to the output; only undecoded framing
+    // is left in response_ between reads.
+    void decode_http_chunked_body() {
+        const char *data = static_cast<const char *>(response_.data().data());
+        size_t consumed = 0;
+
+        ChunkedDecoder::Result decoded = chunked_.Decode(
+                data, response_.size(), consumed,
+                std::bind(&HttpClient::write_body, this, _1, _2));
+        response_.consume(consumed);
+
+        if (body_failed()) {
+            return;
+        }
+
+        switch (decoded) {
+            case ChunkedDecoder::NeedMore:
+                read_http_chunked_body();
+                return;
+            case ChunkedDecoder::Invalid:
+                fail(fmt::format("Invalid chunked body from {}", host_));
+                return;
+            case ChunkedDecoder::Done:
+                break;
+        }
+
+        complete_body();
+    }
+
+    void handle_http_body(const boost::system::error_code &ec) {
+        // Without a length the body ends when the server closes the connection.
+        if (ec == asio::error::eof && bodyLength_ == std::string::npos) {
+            complete_body();
+            return;
+        }
+
+        if (ec) {
+            fail(fmt::format("Error receiving body: {}: {}", ec.category().name(), ec.value()));
+            return;
+        }
+
+        do_receive_http_body();
+    }
+
+    void write_body(const char *data, size_t size) {
+        result_.bodySize += size;
+        if (sink_ == nullptr || size == 0 || sinkFailed_ || decodeFailed_) {
+            return;
+        }
+        if (!content_.Active()) {
+            sinkFailed_ = !sink_->Write(data, size);
+            return;
+        }
+        decodeFailed_ = !content_.Decode(data, size, [this](const char *decoded, size_t decodedSize) {
+            sinkFailed_ = sinkFailed_ || !sink_->Write(decoded, decodedSize);
+        });
+    }
+
+    // Fails the request if the body could not be decoded or written.
+    bool body_failed() {
+        if (decodeFailed_) {
+            fail(fmt::format("Invalid coded body from {}", host_));
+        } else if (sinkFailed_) {
+            fail(fmt::format("Error writing body from {}", host_));
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    void complete_body() {
+        if (!content_.Finished()) {
+            fail(fmt::format("Truncated coded body from {}", host_));
+            return;
+        }
+        if (verbose_) {
+            LOG_DEBUG("{}: body length {}\n", host_, result_.bodySize);
+        }
+
+        release_connection();
+        finish();
+    }
+};
+
+const size_t HttpClient::kReadSize;
+
+// A cleartext HTTP/2 connection started with prior knowledge (RFC 9113
+// section 3.3). Requests added to it are multiplexed as concurrent streams,
+// up to the server's limit, with the rest queued until a stream closes; each
+// result is reported as its stream ends. The receive windows are raised to a
+// configurable size so a fast server is not throttled by WINDOW_UPDATE
+// round trips.
+class Http2Connection {
+public:
+    static const uint32_t kDefaultWindow = 16 * 1024 * 1024;
+
+    // request is the number Add() returned for the request.
+    using Handler = std::function<void(size_t request, const std::string &path, const HttpResult &result)>;
+
+    Http2Connection(asio::io_service &io_service, DnsCache &dns, ConnectionPool &pool,
+                    std::string host, std::string port, std::string body, std::string method)
+            : method_(std::move(method)), body_(std::move(body)), host_(std::move(host)), port_(std::move(port)),
+              authority_(Url::FormatAuthority(host_, port_)), dns_(dns), pool_(pool), sock_(io_service),
+              connector_(io_service, pool) {}
+
+    ~Http2Connection() {
+        cancel_timeouts();
+    }
+
+    // Called as each request completes or fails. The handler may destroy the
+    // connection once nothing is pending.
+    void OnDone(Handler handler) {
+        onDone_ = std::move(handler);
+    }
+
+    // Queues a request; all of them should be added before Start(). The
+    // response body is streamed to sink as its DATA frames arrive; without
+    // one it is dropped. Requests are numbered from 0 in the order added.
+    size_t Add(std::string path, BodySink *sink) {
+        size_t request = added_++;
+        queued_.push_back({request, std::move(path), sink, std::chrono::steady_clock::now()});
+        return request;
+    }
+
+    // Receive window for the connection and for each stream; takes effect
+    // when the connection starts.
+    void SetWindow(uint32_t window) {
+        window_ = std::min<uint32_t>(std::max<uint32_t>(window, kDefaultInitialWindow), kMaxWindow);
+    }
+
+    // Progress, headers and errors are printed unless disabled.
+    void SetVerbose(bool verbose) {
+        verbose_ = verbose;
+        connector_.SetVerbose(verbose);
+    }
+
+    // Fails requests that exceed the given limits, timed on wheel. The connect
+    // and total limits apply to the connection, which carries every request
+    // from Start(); the first-byte and idle limits apply to each stream.
+    void SetTimeouts(TimerWheel &wheel, const Timeouts &timeouts) {
+        wheel_ = &wheel;
+        timeouts_ = timeouts;
+    }
+
+    // Requests not yet reported.
+    size_t Pending() const {
+        return queued_.size() + streams_.size();
+    }
+
+    std::string GetHost() const {
+        return host_;
+    }
+
+    void Start() {
+        totalTimer_ = schedule(timeouts_.total, [this]() {
+            totalTimer_ = 0;
+            abort(fmt::format("Total timeout for {}", host_));
+        });
+
+        resolving_ = true;
+        dns_.Resolve(
+                host_, port_,
+                [this](const boost::system::error_code &ec, const DnsCache::Endpoints &endpoints) {
+                    resolving_ = false;
+                    if (!abortError_.empty()) {
+                        fail_all(abortError_);
+                        return;
+                    }
+                    if (ec) {
+                        fail_all(fmt::format("Error resolving {}: {}", host_, ec.message()));
+                        return;
+                    }
+                    resolvedAt_ = std::chrono::steady_clock::now();
+
+                    connectTimer_ = schedule(timeouts_.connect, [this]() {
+                        connectTimer_ = 0;
+                        abort(fmt::format("Connect timeout for {}", host_));
+                    });
+                    connector_.Connect(
+                            host_, pool_.Order(host_, port_, *endpoints), sock_,
+                            std::bind(&Http2Connection::handle_connect, this, _1, _2));
+                });
+    }
+
+private:
+    enum FrameType : uint8_t {
+        Data = 0x0,
+        Headers = 0x1,
+        Priority = 0x2,
+        RstStream = 0x3,
+        Settings = 0x4,
+        PushPromise = 0x5,
+        Ping = 0x6,
+        GoAway = 0x7,
+        WindowUpdate = 0x8,
+        Continuation = 0x9,
+    };
+
+    enum FrameFlag : uint8_t {
+        EndStream = 0x1,
+        Ack = 0x1,
+        EndHeaders = 0x4,
+        Padded = 0x8,
+        PriorityFlag = 0x20,
+    };
+
+    enum ErrorCode : uint32_t {
+        NoError = 0x0,
+        ProtocolError = 0x1,
+        FlowControlError = 0x3,
+        FrameSizeError = 0x6,
+        Cancel = 0x8,
+        CompressionError = 0x9,
+    };
+
+    static const size_t kFrameHeaderSize = 9;
+    static const uint32_t kMaxFrameSize = 16384;
+    static const uint32_t kDefaultInitialWindow = 65535;
+    static const uint32_t kMaxWindow = 0x7fffffff;
+    static const size_t kReadSize = 64 * 1024;
+
+    struct Queued {
+        size_t request;
+        std::string path;
+        BodySink *sink;
+        std::chrono::steady_clock::time_point added;
+    };
+
+    struct Stream {
+        size_t request = 0;
+        std::string path;
+        BodySink *sink = nullptr;
+        HttpResult result;
+        std::chrono::steady_clock::time_point added;
+        int64_t sendWindow = 0;
+        int64_t recvWindow = 0;
+        uint32_t recvUnacked = 0;
+        size_t bodySent = 0;
+        bool bodyDone = false;
+        bool headersDone = false;
+        // Set for a gzip or deflate body written to the sink.
+        std::unique_ptr<ContentDecoder> content;
+        // The first-byte limit until the response starts, then the idle limit.
+        TimerWheel::Handle timer = 0;
+    };
+
+    const std::string method_;
+    const std::string body_;
+    const std::string host_;
+    const std::string port_;
+    const std::string authority_;
+
+    DnsCache &dns_;
+    ConnectionPool &pool_;
+    asio::ip::tcp::socket sock_;
+    Connector connector_;
+    asio::ip::tcp::endpoint endpoint_;
+    bool verbose_ = true;
+
+    TimerWheel *wheel_ = nullptr;
+    Timeouts timeouts_;
+    TimerWheel::Handle totalTimer_ = 0;
+    TimerWheel::Handle connectTimer_ = 0;
+    // Set once a connection-wide limit expires; whatever the connection is
+    // waiting on then fails everything with it.
+    std::string abortError_;
+    bool resolving_ = false;
+
+    bool connected_ = false;
+    bool closed_ = false;
+    bool goAway_ = false;
+    std::chrono::steady_clock::time_point resolvedAt_;
+    std::chrono::steady_clock::time_point connectedAt_;
+
+    HpackEncoder encoder_;
+    HpackDecoder decoder_;
+
+    asio::streambuf in_;
+    // Frames are queued in out_ while the previous batch is being written.
+    std::string out_;
+    std::string writing_;
+
+    struct Done {
+        size_t request;
+        std::string path;
+        HttpResult result;
+    };
+
+    size_t added_ = 0;
+    std::deque<Queued> queued_;
+    std::map<uint32_t, Stream> streams_;
+    std::vector<Done> done_;
+    uint32_t nextStreamId_ = 1;
+
+    // Settings of the server; streams are limited to the RFC's recommended
+    // minimum until its SETTINGS arrive.
+    size_t peerMaxStreams_ = 100;
+    uint32_t peerInitialWindow_ = kDefaultInitialWindow;
+    uint32_t peerMaxFrame_ = kMaxFrameSize;
+
+    uint32_t window_ = kDefaultWindow;
+    int64_t sendWindow_ = kDefaultInitialWindow;
+    int64_t recvWindow_ = kDefaultInitialWindow;
+    uint32_t recvUnacked_ = 0;
+
+    // A header block being continued in CONTINUATION frames.
+    uint32_t headerStream_ = 0;
+    bool headerEndStream_ = false;
+    std::string headerBlock_;
+
+    Handler onDone_;
+
+    static uint32_t read_u32(const uint8_t *data) {
+        return static_cast<uint32_t>(data[0]) << 24 | static_cast<uint32_t>(data[1]) << 16 |
+               static_cast<uint32_t>(data[2]) << 8 | data[3];
+    }
+
+    // Time from a request being added to a connection-wide event, which may
+    // have happened before the request was added.
+    static std::chrono::steady_clock::duration since_added(const Stream &stream,
+                                                           std::chrono::steady_clock::time_point at) {
+        return std::max(at - stream.added, std::chrono::steady_clock::duration::zero());
+    }
+
+    static void append_u32(std::string &out, uint32_t value) {
+        out += static_cast<char>(value >> 24);
+        out += static_cast<char>(value >> 16);
+        out += static_cast<char>(value >> 8);
+        out += static_cast<char>(value);
+    }
+
+    // Schedules callback after limit on the wheel; a zero limit or no wheel
+    // schedules nothing.
+    TimerWheel::Handle schedule(std::chrono::steady_clock::duration limit, std::function<void()> callback) {
+        if (wheel_ == nullptr || limit == std::chrono::steady_clock::duration::zero()) {
+            return 0;
+        }
+        return wheel_->Schedule(limit, std::move(callback));
+    }
+
+    void cancel_timer(TimerWheel::Handle &timer) {
+        if (wheel_ != nullptr) {
+            wheel_->Cancel(timer);
+        }
+        timer = 0;
+    }
+
+    void cancel_timeouts() {
+        cancel_timer(totalTimer_);
+        cancel_timer(connectTimer_);
+        for (auto &entry : streams_) {
+            cancel_timer(entry.second.timer);
+        }
+    }
+
+    // Replaces the limit on a stream's current phase.
+    void arm_stream(uint32_t id, Stream &stream, std::chrono::steady_clock::duration limit, const char *phase) {
+        cancel_timer(stream.timer);
+        stream.timer = schedule(limit, [this, id, phase]() {
+            auto it = streams_.find(id);
+            if (it == streams_.end()) {
+                return;
+            }
+            it->second.timer = 0;
+            expire_stream(id, fmt::format("{} timeout for {}", phase, host_));
+        });
+    }
+
+    // Fails a stream that ran out of time while the connection carries on
+    // with the others. The last outstanding request instead aborts the
+    // connection, so the pending read reports it and nothing is left running
+    // once the connection may be destroyed.
+    void expire_stream(uint32_t id, std::string error) {
+        if (Pending() > 1) {
+            fail_stream(id, std::move(error), true);
+            flush();
+            deliver();
+            return;
+        }
+        abort(std::move(error));
+    }
+
+    // Aborts whatever the connection is waiting on, so that operation fails
+    // every request with error. A lookup in progress is left to finish.
+    void abort(std::string error) {
+        if (!abortError_.empty() || closed_) {
+            return;
+        }
+        abortError_ = std::move(error);
+        if (resolving_) {
+            return;
+        }
+        if (!connected_) {
+            connector_.Cancel();
+            return;
+        }
+        close();
+    }
+
+    void handle_connect(const boost::system::error_code &ec, const asio::ip::tcp::endpoint &dest) {
+        cancel_timer(connectTimer_);
+        if (!abortError_.empty()) {
+            fail_all(abortError_);
+            return;
+        }
+        if (ec) {
+            fail_all(fmt::format("Error connecting to {}: {}", host_, ec.message()));
+            return;
+        }
+
+        endpoint_ = dest;
+        connected_ = true;
+        connectedAt_ = std::chrono::steady_clock::now();
+        if (verbose_) {
+            LOG_DEBUG("{}: connected to {}:{} (h2c)\n", host_, dest.address().to_string(), dest.port());
+        }
+
+        out_ += "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        std::string settings;
+        append_setting(settings, 0x2, 0);
+        append_setting(settings, 0x4, window_);
+        queue_frame(Settings, 0, 0, settings);
+        if (window_ > kDefaultInitialWindow) {
+            queue_window_update(0, window_ - kDefaultInitialWindow);
+        }
+        recvWindow_ = window_;
+
+        open_streams();
+        flush();
+        read();
+    }
+
+    static void append_setting(std::string &out, uint16_t id, uint32_t value) {
+        out += static_cast<char>(id >> 8);
+        out += static_cast<char>(id);
+        append_u32(out, value);
+    }
+
+    void queue_frame(FrameType type, uint8_t flags, uint32_t stream, const std::string &payload) {
+        uint32_t length = static_cast<uint32_t>(payload.size());
+        out_ += static_cast<char>(length >> 16);
+        out_ += static_cast<char>(length >> 8);
+        out_ += static_cast<char>(length);
+        out_ += static_cast<char>(type);
+        out_ += static_cast<char>(flags);
+        append_u32(out_, stream);
+        out_ += payload;
+    }
+
+    void queue_window_update(uint32_t stream, uint32_t increment) {
+        std::string payload;
+        append_u32(payload, increment);
+        queue_frame(WindowUpdate, 0, stream, payload);
+    }
+
+    void queue_rst_stream(uint32_t stream, ErrorCode code) {
+        std::string payload;
+        append_u32(payload, code);
+        queue_frame(RstStream, 0, stream, payload);
+    }
+
+    void flush() {
+        if (closed_ || !writing_.empty() || out_.empty()) {
+            return;
+        }
+
+        writing_.swap(out_);
+        asio::async_write(
+                sock_, asio::buffer(writing_),
+                [this](const boost::system::error_code &ec, std::size_t) {
+                    writing_.clear();
+                    // A broken connection is reported by the pending read.
+                    if (!ec) {
+                        flush();
+                    }
+                });
+    }
+
+    void read() {
+        sock_.async_read_some(
+                in_.prepare(kReadSize),
+                [this](const boost::system::error_code &ec, std::size_t size) {
+                    if (ec) {
+                        if (!abortError_.empty()) {
+                            fail_all(abortError_);
+                        } else if (!closed_) {
+                            fail_all(ec == asio::error::eof
+                                     ? fmt::format("Connection to {} closed by server", host_)
+                                     : fmt::format("Error receiving from {}: {}", host_, ec.message()));
+                        }
+                        return;
+                    }
+
+                    in_.commit(size);
+                    if (!process_frames()) {
+                        return;
+                    }
+
+                    open_streams();
+                    flush();
+                    if (Pending() != 0) {
+                        read();
+                    } else {
+                        close();
+                    }
+                    deliver();
+                });
+    }
+
+    bool process_frames() {
+        while (in_.size() >= kFrameHeaderSize) {
+            const uint8_t *data = static_cast<const uint8_t *>(in_.data().data());
+            uint32_t length = static_cast<uint32_t>(data[0]) << 16 | static_cast<uint32_t>(data[1]) << 8 | data[2];
+            if (length > kMaxFrameSize) {
+                return connection_error(FrameSizeError, "oversized frame");
+            }
+            if (in_.size() < kFrameHeaderSize + length) {
+                break;
+            }
+
+            uint8_t type = data[3];
+            uint8_t flags = data[4];
+            uint32_t stream = read_u32(data + 5) & 0x7fffffff;
+            if (!handle_frame(type, flags, stream, data + kFrameHeaderSize, length)) {
+                return false;
+            }
+            in_.consume(kFrameHeaderSize + length);
+        }
+        return true;
+    }
+
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream, const uint8_t *payload, uint32_t length) {
+        if (headerStream_ != 0 && (type != Continuation || stream != headerStream_)) {
+            return connection_error(ProtocolError, "interrupted header block");
+        }
+
+        switch (type) {
+            case Data:
+                return handle_data(flags, stream, payload, length);
+            case Headers:
+                return handle_headers(flags, stream, payload, length);
+            case Continuation:
+                if (headerStream_ == 0) {
+                    return connection_error(ProtocolError, "unexpected CONTINUATION");
+                }
+                headerBlock_.append(reinterpret_cast<const char *>(payload), length);
+                return (flags & EndHeaders) == 0 || end_headers();
+            case RstStream:
+                if (stream == 0 || length != 4) {
+                    return connection_error(ProtocolError, "malformed RST_STREAM");
+                }
+                fail_stream(stream, fmt::format("Stream reset by {}: error {}", host_, read_u32(payload)), false);
+                return true;
+            case Settings:
+                return handle_settings(flags, stream, payload, length);
+            case PushPromise:
+                return connection_error(ProtocolError, "PUSH_PROMISE with push disabled");
+            case Ping:
+                if (stream != 0 || length != 8) {
+                    return connection_error(ProtocolError, "malformed PING");
+                }
+                if ((flags & Ack) == 0) {
+                    queue_frame(Ping, Ack, 0, std::string(reinterpret_cast<const char *>(payload), length));
+                }
+                return true;
+            case GoAway:
+                if (stream != 0 || length < 8) {
+                    return connection_error(ProtocolError, "malformed GOAWAY");
+                }
+                handle_go_away(read_u32(payload) & 0x7fffffff, read_u32(payload + 4));
+                return true;
+            case WindowUpdate:
+                return handle_window_update(stream, payload, length);
+            default:
+                // PRIORITY and unknown frame types are ignored.
+                return true;
+        }
+    }
+
+    bool handle_data(uint8_t flags, uint32_t id, const uint8_t *payload, uint32_t length) {
+        if (id == 0) {
+            return connection_error(ProtocolError, "DATA on stream 0");
+        }
+
+        // Flow control covers the whole payload, padding included.
+        recvWindow_ -= length;
+        if (recvWindow_ < 0) {
+            return connection_error(FlowControlError, "connection window exceeded");
+        }
+        recvUnacked_ += length;
+        if (recvUnacked_ >= window_ / 2) {
+            queue_window_update(0, recvUnacked_);
+            recvWindow_ += recvUnacked_;
+            recvUnacked_ = 0;
+        }
+
+        uint32_t padding = 0;
+        if (flags & Padded) {
+            if (length == 0 || payload[0] >= length) {
+                return connection_error(ProtocolError, "bad DATA padding");
+            }
+            padding = payload[0];
+        }
+
+        auto it = streams_.find(id);
+        if (it == streams_.end()) {
+            // Frames still in flight for a stream that was reset.
+            return true;
+        }
+
+        Stream &stream = it->second;
+        if (!stream.headersDone) {
+            fail_stream(id, fmt::format("DATA before response headers from {}", host_), true);
+            return true;
+        }
+
+        stream.recvWindow -= length;
+        if (stream.recvWindow < 0) {
+            fail_stream(id, fmt::format("Stream window exceeded by {}", host_), true);
+            return true;
+        }
+
+        if (!(flags & EndStream)) {
+            arm_stream(id, stream, timeouts_.idle, "Idle");
+        }
+
+        size_t offset = (flags & Padded) ? 1 : 0;
+        size_t size = length - offset - padding;
+        stream.result.bodySize += size;
+        const char *data = reinterpret_cast<const char *>(payload + offset);
+        if (stream.sink != nullptr && size != 0 && !write_body(stream, data, size)) {
+            fail_stream(id, std::move(stream.result.error), true);
+            return true;
+        }
+
+        if (flags & EndStream) {
+            complete_stream(id);
+            return true;
+        }
+
+        stream.recvUnacked += length;
+        if (stream.recvUnacked >= window_ / 2) {
+            queue_window_update(id, stream.recvUnacked);
+            stream.recvWindow += stream.recvUnacked;
+            stream.recvUnacked = 0;
+        }
+        return true;
+    }
+
+    bool handle_headers(uint8_t flags, uint32_t id, const uint8_t *payload, uint32_t length) {
+        if (id == 0) {
+            return connection_error(ProtocolError, "HEADERS on stream 0");
+        }
+
+        size_t offset = 0;
+        size_t padding = 0;
+        if (flags & Padded) {
+            if (length == 0) {
+                return connection_error(ProtocolError, "bad HEADERS padding");
+            }
+            padding = payload[0];
+            offset = 1;
+        }
+        if (flags & PriorityFlag) {
+            offset += 5;
+        }
+        if (offset + padding > length) {
+            return connection_error(ProtocolError, "bad HEADERS padding");
+        }
+
+        headerStream_ = id;
+        headerEndStream_ = (flags & EndStream) != 0;
+        headerBlock_.assign(reinterpret_cast<const char *>(payload + offset), length - offset - padding);
+        return (flags & EndHeaders) == 0 || end_headers();
+    }
+
+    // Every header block is decoded, even for streams already given up on,
+    // to keep the HPACK table in step with the server.
+    bool end_headers() {
+        uint32_t id = headerStream_;
+        headerStream_ = 0;
+
+        HeaderFields headers;
+        if (!decoder_.Decode(reinterpret_cast<const uint8_t *>(headerBlock_.data()), headerBlock_.size(), headers)) {
+            return connection_error(CompressionError, "invalid header block");
+        }
+
+        auto it = streams_.find(id);
+        if (it == streams_.end()) {
+            return true;
+        }
+
+        Stream &stream = it->second;
+        if (stream.result.firstByte == std::chrono::steady_clock::duration::zero()) {
+            stream.result.firstByte = since_added(stream, std::chrono::steady_clock::now());
+        }
+        if (!stream.headersDone) {
+            int status = 0;
+            for (char c : headers.Find(KnownHeader::Status)) {
+                if (c < '0' || c > '9' || status > 999) {
+                    status = 0;
+                    break;
+                }
+                status = status * 10 + (c - '0');
+            }
+            if (status < 100 || status > 999) {
+                fail_stream(id, fmt::format("Invalid response header from {}", host_), true);
+                return true;
+            }
+
+            if (verbose_ && MYCURL_LOG_ENABLED(DEBUG)) {
+                fmt::memory_buffer head;
+                for (const HeaderFields::Field header : headers) {
+                    fmt::format_to(std::back_inserter(head), "{}: {}\n", header.name, header.value);
+                }
+                LOG_DEBUG("{}: stream {} headers\n{}", host_, id, fmt::to_string(head));
+            }
+
+            // Interim responses are followed by the real one on the same stream.
+            if (status < 200) {
+                return true;
+            }
+            stream.result.status = status;
+            stream.headersDone = true;
+            arm_stream(id, stream, timeouts_.idle, "Idle");
+
+            ContentDecoder::Coding coding = ContentDecoder::Parse(headers.Find(KnownHeader::ContentEncoding));
+            if (stream.sink != nullptr && coding != ContentDecoder::Identity) {
+                stream.content.reset(new ContentDecoder());
+                if (!stream.content->Start(coding)) {
+                    fail_stream(id, fmt::format("Error setting up decoding of the body from {}", host_), true);
+                    return true;
+                }
+            }
+        }
+
+        if (headerEndStream_) {
+            complete_stream(id);
+        }
+        return true;
+    }
+
+    bool handle_settings(uint8_t flags, uint32_t stream, const uint8_t *payload, uint32_t length) {
+        if (stream != 0 || length % 6 != 0 || ((flags & Ack) && length != 0)) {
+            return connection_error(FrameSizeError, "malformed SETTINGS");
+        }
+        if (flags & Ack) {
+            return true;
+        }
+
+        for (uint32_t i = 0; i < length; i += 6) {
+            uint16_t id = static_cast<uint16_t>(payload[i] << 8 | payload[i + 1]);
+            uint32_t value = read_u32(payload + i + 2);
+            switch (id) {
+                case 0x1:
+                    encoder_.SetMaxTableSize(value);
+                    break;
+                case 0x3:
+                    peerMaxStreams_ = value;
+                    break;
+                case 0x4: {
+                    if (value > kMaxWindow) {
+                        return connection_error(FlowControlError, "initial window too large");
+                    }
+                    int64_t delta = static_cast<int64_t>(value) - peerInitialWindow_;
+                    for (auto &entry : streams_) {
+                        entry.second.sendWindow += delta;
+                    }
+                    peerInitialWindow_ = value;
+                    break;
+                }
+                case 0x5:
+                    if (value < kMaxFrameSize || value > 0xffffff) {
+                        return connection_error(ProtocolError, "invalid max frame size");
+                    }
+                    peerMaxFrame_ = value;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        queue_frame(Settings, Ack, 0, std::string());
+        send_data();
+        return true;
+    }
+
+    bool handle_window_update(uint32_t id, const uint8_t *payload, uint32_t length) {
+        if (length != 4) {
+            return connection_error(FrameSizeError, "malformed WINDOW_UPDATE");
+        }
+
+        uint32_t increment = read_u32(payload) & 0x7fffffff;
+        if (increment == 0) {
+            return connection_error(ProtocolError, "zero WINDOW_UPDATE");
+        }
+
+        if (id == 0) {
+            sendWindow_ += increment;
+            if (sendWindow_ > kMaxWindow) {
+                return connection_error(FlowControlError, "connection window overflow");
+            }
+        } else {
+            auto it = streams_.find(id);
+            if (it != streams_.end()) {
+                it->second.sendWindow += increment;
+            }
+        }
+        send_data();
+        return true;
+    }
+
+    // Streams above lastStream were never processed by the server; no new
+    // ones are opened, and the queued requests fail.
+    void handle_go_away(uint32_t lastStream, uint32_t code) {
+        goAway_ = true;
+        std::string error = fmt::format("Connection to {} shut down by server: error {}", host_, code);
+
+        std::vector<uint32_t> refused;
+        for (const auto &entry : streams_) {
+            if (entry.first > lastStream) {
+                refused.push_back(entry.first);
+            }
+        }
+        for (uint32_t id : refused) {
+            fail_stream(id, error, false);
+        }
+
+        for (auto &queued : queued_) {
+            HttpResult result;
+            result.error = error;
+            result.elapsed = std::chrono::steady_clock::now() - queued.added;
+            done_.push_back({queued.request, std::move(queued.path), std::move(result)});
+        }
+        queued_.clear();
+    }
+
+    void open_streams() {
+        while (connected_ && !goAway_ && !queued_.empty() && streams_.size() < peerMaxStreams_ &&
+               nextStreamId_ <= 0x7fffffff) {
+            uint32_t id = nextStreamId_;
+            nextStreamId_ += 2;
+
+            Stream &stream = streams_[id];
+            stream.request = queued_.front().request;
+            stream.path = std::move(queued_.front().path);
+            stream.sink = queued_.front().sink;
+            stream.added = queued_.front().added;
+            stream.sendWindow = peerInitialWindow_;
+            stream.recvWindow = window_;
+            stream.bodyDone = method_ != "POST" || body_.empty();
+            stream.result.resolved = since_added(stream, resolvedAt_);
+            stream.result.connected = since_added(stream, connectedAt_);
+            if (stream.bodyDone) {
+                stream.result.sent = since_added(stream, std::chrono::steady_clock::now());
+            }
+            queued_.pop_front();
+
+            HeaderFields headers{
+                {":method", method_},
+                {":scheme", "http"},
+                {":authority", authority_},
+                {":path", stream.path},
+                {"user-agent", "mycurl/1.0"},
+            };
+            // Bodies without a sink are only counted, so they are left uncoded.
+            if (stream.sink != nullptr) {
+                headers.Add("accept-encoding", "gzip, deflate");
+            }
+            if (method_ == "POST") {
+                headers.Add("content-length", std::to_string(body_.size()));
+            }
+
+            std::string block;
+            encoder_.Encode(headers, block);
+            queue_header_block(id, block, stream.bodyDone);
+            arm_stream(id, stream, timeouts_.firstByte, "First byte");
+
+            pool_.BeginRequest(endpoint_);
+            if (verbose_) {
+                LOG_DEBUG("{}: stream {}: {} {}\n", host_, id, method_, stream.path);
+            }
+        }
+        send_data();
+    }
+
+    void queue_header_block(uint32_t id, const std::string &block, bool endStream) {
+        size_t offset = 0;
+        bool first = true;
+        do {
+            size_t size = std::min<size_t>(block.size() - offset, peerMaxFrame_);
+            bool last = offset + size == block.size();
+            uint8_t flags = static_cast<uint8_t>((last ? EndHeaders : 0) | (first && endStream ? EndStream : 0));
+            queue_frame(first ? Headers : Continuation, flags, id, block.substr(offset, size));
+            offset += size;
+            first = false;
+        } while (offset < block.size());
+    }
+
+    // Sends as much of the request bodies as the flow-control windows allow.
+    void send_data() {
+        for (auto &entry : streams_) {
+            Stream &stream = entry.second;
+            while (!stream.bodyDone) {
+                int64_t size = std::min<int64_t>({static_cast<int64_t>(body_.size() - stream.bodySent),
+                                                  sendWindow_, stream.sendWindow,
+                                                  static_cast<int64_t>(peerMaxFrame_)});
+                if (size <= 0) {
+                    break;
+                }
+
+                stream.bodyDone = stream.bodySent + size == body_.size();
+                queue_frame(Data, stream.bodyDone ? EndStream : 0, entry.first, body_.substr(stream.bodySent, size));
+                stream.bodySent += size;
+                sendWindow_ -= size;
+                stream.sendWindow -= size;
+                if (stream.bodyDone) {
+                    stream.result.sent = since_added(stream, std::chrono::steady_clock::now());
+                }
+            }
+        }
+    }
+
+    // Writes body data to the sink, inflating it first if it is coded. On
+    // failure the error is left in the stream's result.
+    bool write_body(Stream &stream, const char *data, size_t size) {
+        if (!stream.content) {
+            if (!stream.sink->Write(data, size)) {
+                stream.result.error = fmt::format("Error writing body from {}", host_);
+                return false;
+            }
+            return true;
+        }
+
+        bool written = true;
+        BodySink *sink = stream.sink;
+        bool decoded = stream.content->Decode(data, size, [sink, &written](const char *out, size_t outSize) {
+            written = written && sink->Write(out, outSize);
+        });
+        if (!decoded) {
+            stream.result.error = fmt::format("Invalid coded body from {}", host_);
+        } else if (!written) {
+            stream.result.error = fmt::format("Error writing body from {}", host_);
+        }
+        return decoded && written;
+    }
+
+    void complete_stream(uint32_t id) {
+        auto it = streams_.find(id);
+        Stream &stream = it->second;
+        if (stream.content && !stream.content->Finished()) {
+            fail_stream(id, fmt::format("Truncated coded body from {}", host_), false);
+            return;
+        }
+        cancel_timer(stream.timer);
+        stream.result.elapsed = std::chrono::steady_clock::now() - stream.added;
+        if (verbose_) {
+            LOG_DEBUG("{}: stream {} body length {}\n", host_, id, stream.result.bodySize);
+        }
+
+        pool_.EndRequest(endpoint_);
+        done_.push_back({stream.request, std::move(stream.path), std::move(stream.result)});
+        streams_.erase(it);
+    }
+
+    void fail_stream(uint32_t id, std::string error, bool reset) {
+        auto it = streams_.find(id);
+        if (it == streams_.end()) {
+            return;
+        }
+
+        if (verbose_) {
+            LOG_WARN("{}\n", error);
+        }
+        if (reset) {
+            queue_rst_stream(id, Cancel);
+        }
+
+        Stream &stream = it->second;
+        cancel_timer(stream.timer);
+        stream.result.error = std::move(error);
+        stream.result.elapsed = std::chrono::steady_clock::now() - stream.added;
+        pool_.EndRequest(endpoint_);
+        done_.push_back({stream.request, std::move(stream.path), std::move(stream.result)});
+        streams_.erase(it);
+    }
+
+    // Sends GOAWAY on a best-effort basis and fails everything outstanding.
+    // The send does not block, so a peer that has stopped reading cannot
+    // stall the event loop; whatever does not fit in the socket buffer, or
+    // would land in the middle of a write in progress, is dropped.
+    bool connection_error(ErrorCode code, const char *reason) {
+        std::string payload;
+        append_u32(payload, 0);
+        append_u32(payload, code);
+        queue_frame(GoAway, 0, 0, payload);
+        if (writing_.empty()) {
+            ssize_t ignored = ::send(sock_.native_handle(), out_.data(), out_.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            (void) ignored;
+        }
+
+        fail_all(fmt::format("HTTP/2 error from {}: {}", host_, reason));
+        return false;
+    }
+
+    void close() {
+        closed_ = true;
+        cancel_timer(totalTimer_);
+        cancel_timer(connectTimer_);
+        boost::system::error_code ignored;
+        sock_.close(ignored);
+    }
+
+    void fail_all(std::string error) {
+        if (verbose_) {
+            LOG_WARN("{}\n", error);
+        }
+        close();
+        cancel_timeouts();
+
+        auto now = std::chrono::steady_clock::now();
+        for (auto &entry : streams_) {
+            if (connected_) {
+                pool_.EndRequest(endpoint_);
+            }
+            entry.second.result.error = error;
+            entry.second.result.elapsed = now - entry.second.added;
+            done_.push_back({entry.second.request, std::move(entry.second.path), std::move(entry.second.result)});
+        }
+        streams_.clear();
+
+        for (auto &queued : queued_) {
+            HttpResult result;
+            result.error = error;
+            result.elapsed = now - queued.added;
+            done_.push_back({queued.request, std::move(queued.path), std::move(result)});
+        }
+        queued_.clear();
+        deliver();
+    }
+
+    // Reports finished requests. It is the last thing any handler does, as
+    // the connection may be destroyed once the last result is delivered.
+    void deliver() {
+        std::vector<Done> done;
+        done.swap(done_);
+        Handler handler = onDone_;
+        for (const auto &entry : done) {
+            if (handler) {
+                handler(entry.request, entry.path, entry.result);
+            }
+        }
+    }
+};
+
+const uint32_t Http2Connection::kDefaultInitialWindow;
+const uint32_t Http2Connection::kMaxWindow;
+
+// Expands a curl-style --write-out format for one request: %{variable}
+// names a field of the result, times are in seconds since the request
+// started, and \n, \t and \r are escapes. Unknown variables are left as is.
+std::string format_write_out(const std::string &format, const std::string &url, const HttpResult &result) {
+    auto seconds = [](std::chrono::steady_clock::duration time) {
+        return fmt::format("{:.6f}", std::chrono::duration<double>(time).count());
+    };
+
+    std::string out;
+    for (size_t i = 0; i < format.size(); ++i) {
+        char c = format[i];
+        if (c == '\\' && i + 1 < format.size()) {
+            switch (format[i + 1]) {
+                case 'n':
+                    out += '\n';
+                    ++i;
+                    continue;
+                case 't':
+                    out += '\t';
+                    ++i;
+                    continue;
+                case 'r':
+                    out += '\r';
+                    ++i;
+                    continue;
+                case '\\':
+                    out += '\\';
+                    ++i;
+                    continue;
+            }
+        } else if (c == '%' && format.compare(i, 2, "%%") == 0) {
+            out += '%';
+            ++i;
+            continue;
+        } else if (c == '%' && format.compare(i, 2, "%{") == 0) {
+            size_t end = format.find('}', i + 2);
+            if (end != std::string::npos) {
+                std::string name = format.substr(i + 2, end - i - 2);
+                i = end;
+                if (name == "http_code" || name == "response_code") {
+                    out += fmt::format("{:03d}", result.status);
+                } else if (name == "size_download") {
+                    out += std::to_string(result.bodySize);
+                } else if (name == "time_namelookup") {
+                    out += seconds(result.resolved);
+                } else if (name == "time_connect") {
+                    out += seconds(result.connected);
+                } else if (name == "time_pretransfer") {
+                    out += seconds(result.sent);
+                } else if (name == "time_starttransfer") {
+                    out += seconds(result.firstByte);
+                } else if (name == "time_total") {
+                    out += seconds(result.elapsed);
+                } else if (name == "url") {
+                    out += url;
+                } else if (name == "errormsg") {
+                    out += result.error;
+                } else {
+                    out += "%{" + name + "}";
+                }
+                continue;
+            }
+        }
+        out += c;
+    }
+    return out;
+}
+
+// Runs a list of URLs on one io_service, keeping at most `parallel` requests
+// in flight and reporting each result as it completes. With a pipeline depth
+// above one, each slot instead takes every remaining URL for the same host
+// and port and pipelines them on one connection; with HTTP/2 they are
+// multiplexed on one connection instead. Bodies reach the sink whole and in
+// the order the URLs were added, whichever request finishes first.
+class FetchScheduler {
+public:
+    FetchScheduler(asio::io_service &io_service, DnsCache &dns, ConnectionPool &pool,
+                   BodySink *sink, std::string method, std::string body, size_t parallel, size_t pipeline = 1)
+            : io_service_(io_service), dns_(dns), pool_(pool),
+              output_(sink != nullptr ? new OrderedOutput(*sink) : nullptr), method_(std::move(method)), body_(std::move(body)), slots_(std::max<size_t>(parallel, 1)),
+              pipeline_(std::max<size_t>(pipeline, 1)) {}
+
+    void Add(std::string url) {
+        urls_.push_back({added_++, std::move(url)});
+    }
+
+    // HTTP/1.1 requests do their socket I/O through uring.
+    void UseUring(IoUring *uring) {
+        uring_ = uring;
+    }
+
+    // Requests fail once they exceed timeouts.
+    void UseTimeouts(TimerWheel &wheel, const Timeouts &timeouts) {
+        wheel_ = &wheel;
+        timeouts_ = timeouts;
+    }
+
+    // Speaks h2c with prior knowledge, using window as the receive window.
+    void UseHttp2(uint32_t window) {
+        http2_ = true;
+        window_ = window;
+    }
+
+    // Prints format_write_out(format) to stdout after each request.
+    void SetWriteOut(std::string format) {
+        writeOut_ = std::move(format);
+    }
+
+    void Start() {
+        for (size_t slot = 0; slot < slots_.size(); ++slot) {
+            start_next(slot);
+        }
+    }
+
+    size_t Succeeded() const {
+        return succeeded_;
+    }
+
+    size_t Failed() const {
+        return failed_;
+    }
+
+private:
+    asio::io_service &io_service_;
+    DnsCache &dns_;
+    ConnectionPool &pool_;
+    // Bodies are dropped unread without one.
+    std::unique_ptr<OrderedOutput> output_;
+
+    const std::string method_;
+    const std::string body_;
+
+    // A URL with its position among those added.
+    struct Queued {
+        size_t order;
+        std::string url;
+    };
+
+    size_t added_ = 0;
+    std::deque<Queued> urls_;
+    std::vector<std::unique_ptr<HttpClient>> slots_;
+    std::vector<std::unique_ptr<Http2Connection>> connections_{slots_.size()};
+    // Positions of the requests each slot carries: those still to finish on
+    // an HTTP/1.1 client, or every request by number on an HTTP/2 connection.
+    std::vector<std::deque<size_t>> orders_{slots_.size()};
+    const size_t pipeline_;
+    bool http2_ = false;
+    uint32_t window_ = Http2Connection::kDefaultWindow;
+    IoUring *uring_ = nullptr;
+    TimerWheel *wheel_ = nullptr;
+    Timeouts timeouts_;
+    std::string writeOut_;
+
+    size_t succeeded_ = 0;
+    size_t failed_ = 0;
+
+    void start_next(size_t slot) {
+        slots_[slot].reset();
+        connections_[slot].reset();
+        orders_[slot].clear();
+        if (urls_.empty()) {
+            return;
+        }
+
+        Url url(urls_.front().url);
+        orders_[slot].push_back(urls_.front().order);
+        urls_.pop_front();
+
+        LOG_INFO("{}: fetching {}\n", url.GetHost(), url.GetPath());
+
+        if (http2_) {
+            start_http2(slot, url);
+            return;
+        }
+
+        slots_[slot].reset(new HttpClient(
+                io_service_, dns_, pool_, url.GetHost(), url.GetPort(), url.GetPath(), body_, method_));
+        slots_[slot]->SetSink(part(orders_[slot].front()));
+        slots_[slot]->SetUring(uring_);
+        if (wheel_ != nullptr) {
+            slots_[slot]->SetTimeouts(*wheel_, timeouts_);
+        }
+        if (pipeline_ > 1) {
+            slots_[slot]->SetPipelineDepth(pipeline_);
+            for (auto &same : take_same_host(url)) {
+                orders_[slot].push_back(same.order);
+                slots_[slot]->Enqueue(std::move(same.url));
+            }
+        }
+        slots_[slot]->OnDone([this, slot, url]() {
+            HttpClient &client = *slots_[slot];
+            report(url.WithPath(client.GetPath()), client.Result());
+            finish(orders_[slot].front());
+            orders_[slot].pop_front();
+            if (client.Pending() != 0) {
+                // The next queued response is read as soon as this returns.
+                client.SetSink(part(orders_[slot].front()));
+                return;
+            }
+            // The finished client is still on the call stack, so replace it later.
+            io_service_.post([this, slot]() { start_next(slot); });
+        });
+        slots_[slot]->Start();
+    }
+
+    void start_http2(size_t slot, const Url &url) {
+        connections_[slot].reset(new Http2Connection(
+                io_service_, dns_, pool_, url.GetHost(), url.GetPort(), body_, method_));
+        Http2Connection &connection = *connections_[slot];
+        connection.SetWindow(window_);
+        if (wheel_ != nullptr) {
+            connection.SetTimeouts(*wheel_, timeouts_);
+        }
+        connection.Add(url.GetPath(), part(orders_[slot].front()));
+        for (auto &same : take_same_host(url)) {
+            orders_[slot].push_back(same.order);
+            connection.Add(std::move(same.url), part(same.order));
+        }
+        connection.OnDone([this, slot, url](size_t request, const std::string &path, const HttpResult &result) {
+            report(url.WithPath(path), result);
+            finish(orders_[slot][request]);
+            if (connections_[slot]->Pending() == 0) {
+                io_service_.post([this, slot]() { start_next(slot); });
+            }
+        });
+        connection.Start();
+    }
+
+    // Removes the remaining URLs for the same host and port, returning them
+    // with each URL replaced by its path.
+    std::vector<Queued> take_same_host(const Url &url) {
+        std::vector<Queued> paths;
+        for (auto it = urls_.begin(); it != urls_.end();) {
+            Url other(it->url);
+            if (other.GetHost() != url.GetHost() || other.GetPort() != url.GetPort()) {
+                ++it;
+                continue;
+            }
+
+            LOG_INFO("{}: fetching {}\n", other.GetHost(), other.GetPath());
+            paths.push_back({it->order, other.GetPath()});
+            it = urls_.erase(it);
+        }
+        return paths;
+    }
+
+    BodySink *part(size_t order) {
+        return output_ ? output_->Part(order) : nullptr;
+    }
+
+    void finish(size_t order) {
+        if (output_) {
+            output_->Finish(order);
+        }
+    }
+
+    void report(const Url &url, const HttpResult &result) {
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(result.elapsed).count();
+        std::string fullUrl = url.GetFullUrl();
+
+        if (result.error.empty()) {
+            ++succeeded_;
+            fmt::print(stderr, "{}: {} {} bytes {} ms\n", fullUrl, result.status, result.bodySize, ms);
+        } else {
+            ++failed_;
+            fmt::print(stderr, "{}: failed after {} ms: {}\n", fullUrl, ms, result.error);
+        }
+
+        if (!writeOut_.empty()) {
+            std::string line = format_write_out(writeOut_, fullUrl, result);
+            std::fwrite(line.data(), 1, line.size(), stdout);
+            std::fflush(stdout);
+        }
+    }
+};
+
+// HDR-style log-linear histogram: every power-of-two range is split into
+// equally sized sub-buckets, so recorded values keep about 2 significant
+// digits at any magnitude. Histograms with the same layout merge by adding counts.
+class LatencyHistogram {
+public:
+    void Record(uint64_t value) {
+        ++counts_[index_of(value)];
+        ++total_;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void Merge(const LatencyHistogram &other) {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    // Highest value equivalent to the bucket holding the given percentile.
+    uint64_t Percentile(double percentile) const {
+        if (total_ == 0) {
+            return 0;
+        }
+
+        uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total_ + 0.5);
+        rank = std::max<uint64_t>(rank, 1);
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(highest_equivalent(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    uint64_t Count() const {
+        return total_;
+    }
+
+    uint64_t Min() const {
+        return total_ == 0 ? 0 : min_;
+    }
+
+    uint64_t Max() const {
+        return max_;
+    }
+
+    double Mean() const {
+        return total_ == 0 ? 0.0 : static_cast<double>(sum_) / total_;
+    }
+
+private:
+    static const int kSubBucketBits = 8;
+    static const uint64_t kSubBucketCount = uint64_t(1) << kSubBucketBits;
+    static const uint64_t kSubBucketHalf = kSubBucketCount / 2;
+    static const size_t kBucketCount = kSubBucketCount + (64 - kSubBucketBits) * kSubBucketHalf;
+
+    std::array<uint64_t, kBucketCount> counts_{};
+    uint64_t total_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+
+    static size_t index_of(uint64_t value) {
+        if (value < kSubBucketCount) {
+            return value;
+        }
+        int shift = 64 - __builtin_clzll(value) - kSubBucketBits;
+        uint64_t top = value >> shift;
+        return kSubBucketCount + (shift - 1) * kSubBucketHalf + (top - kSubBucketHalf);
+    }
+
+    static uint64_t highest_equivalent(size_t index) {
+        if (index < kSubBucketCount) {
+            return index;
+        }
+        size_t offset = index - kSubBucketCount;
+        int shift = static_cast<int>(offset / kSubBucketHalf) + 1;
+        uint64_t top = offset % kSubBucketHalf + kSubBucketHalf;
+        return (top << shift) + (uint64_t(1) << shift) - 1;
+    }
+};
+
+struct BenchOptions {
+    size_t concurrency = 10;
+    std::chrono::steady_clock::duration duration = std::chrono::seconds(10);
+    // Stops after this many measured requests instead of after duration if set.
+    size_t requests = 0;
+    std::chrono::steady_clock::duration warmup{};
+    // Requests per second for an open-loop run; 0 runs closed-loop.
+    double rate = 0;
+    bool poisson = false;
+
+    // The part of the load run by shard index of count, each on its own thread.
+    BenchOptions Share(size_t index, size_t count) const {
+        BenchOptions share = *this;
+        share.concurrency = concurrency / count + (index < concurrency % count ? 1 : 0);
+        share.requests = requests / count + (index < requests % count ? 1 : 0);
+        share.rate = rate / count;
+        return share;
+    }
+};
+
+// Load generator over the same HttpClient pipeline and connection pool used
+// for regular fetches.
+//
+// Closed-loop: each of `concurrency` clients sends its next request as soon
+// as the previous one completes.
+//
+// Open-loop (rate set): requests are due at fixed or exponentially distributed
+// intervals regardless of how fast responses arrive. At most `concurrency` are
+// in flight; due requests wait in a backlog for a free client. Latency is
+// measured from the time a request was due, so server stalls show up in the
+// tail instead of silently lowering the send rate (coordinated omission).
+class BenchRunner {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    BenchRunner(asio::io_service &io_service, DnsCache &dns, ConnectionPool &pool,
+                const Url &url, const std::string &method, const std::string &body, BenchOptions options)
+            : io_service_(io_service), options_(options), timer_(io_service), arrivalTimer_(io_service),
+              random_(std::random_device()()), interarrival_(options.rate > 0 ? options.rate : 1.0) {
+        for (size_t i = 0; i < std::max<size_t>(options_.concurrency, 1); ++i) {
+            std::unique_ptr<HttpClient> client(new HttpClient(
+                    io_service, dns, pool, url.GetHost(), url.GetPort(), url.GetPath(), body, method));
+            client->SetVerbose(false);
+            client->OnDone(std::bind(&BenchRunner::handle_done, this, i));
+            workers_.push_back(std::move(client));
+        }
+        intended_.resize(workers_.size());
+    }
+
+    // Workers do their socket I/O through uring.
+    void UseUring(IoUring *uring) {
+        for (auto &worker : workers_) {
+            worker->SetUring(uring);
+        }
+    }
+
+    // Requests exceeding timeouts count as errors.
+    void UseTimeouts(TimerWheel &wheel, const Timeouts &timeouts) {
+        for (auto &worker : workers_) {
+            worker->SetTimeouts(wheel, timeouts);
+        }
+    }
+
+    void Start() {
+        if (options_.rate > 0) {
+            for (size_t i = workers_.size(); i > 0; --i) {
+                idle_.push_back(i - 1);
+            }
+            nextArrival_ = Clock::now();
+            handle_arrivals();
+        } else {
+            for (auto &worker : workers_) {
+                worker->Start();
+            }
+        }
+
+        if (options_.warmup > Clock::duration::zero()) {
+            timer_.expires_after(options_.warmup);
+            timer_.async_wait([this](const boost::system::error_code &ec) {
+                if (!ec) {
+                    begin_measuring();
+                }
+            });
+        } else {
+            begin_measuring();
+        }
+    }
+
+    void Report() const {
+        double seconds = std::chrono::duration<double>(measureEnd_ - measureStart_).count();
+        uint64_t requests = histogram_.Count() + errors_;
+
+        fmt::print("{} requests in {:.2f} s, {} errors\n", requests, seconds, errors_);
+        fmt::print("Requests/sec: {:.1f}\n", seconds > 0 ? histogram_.Count() / seconds : 0.0);
+        if (options_.rate > 0) {
+            fmt::print("Target rate: {:.1f}/s {}, max backlog {}\n",
+                       options_.rate, options_.poisson ? "poisson" : "fixed", maxBacklog_);
+        }
+        fmt::print("Latency (us): min {} mean {:.0f} p50 {} p90 {} p99 {} p99.9 {} max {}\n",
+                   histogram_.Min(), histogram_.Mean(),
+                   histogram_.Percentile(50), histogram_.Percentile(90), histogram_.Percentile(99),
+                   histogram_.Percentile(99.9), histogram_.Max());
+
+        static const char *const kPhaseNames[kPhaseCount] = {"dns", "connect", "send", "ttfb", "transfer"};
+        fmt::print("Phases (us, mean/p50/p99):");
+        for (size_t i = 0; i < kPhaseCount; ++i) {
+            fmt::print(" {} {:.0f}/{}/{}", kPhaseNames[i], phases_[i].Mean(),
+                       phases_[i].Percentile(50), phases_[i].Percentile(99));
+        }
+        fmt::print("\n");
+
+        for (const auto &error : errorCounts_) {
+            fmt::print("  {} x {}\n", error.second, error.first);
+        }
+    }
+
+    // Adds the results of a runner for another share of the same benchmark,
+    // so Report() covers both. The backlog reported is the sum of the shards'
+    // maxima.
+    void Merge(const BenchRunner &other) {
+        histogram_.Merge(other.histogram_);
+        for (size_t i = 0; i < kPhaseCount; ++i) {
+            phases_[i].Merge(other.phases_[i]);
+        }
+        errors_ += other.errors_;
+        for (const auto &error : other.errorCounts_) {
+            errorCounts_[error.first] += error.second;
+        }
+        maxBacklog_ += other.maxBacklog_;
+        options_.rate += other.options_.rate;
+        measureStart_ = std::min(measureStart_, other.measureStart_);
+        measureEnd_ = std::max(measureEnd_, other.measureEnd_);
+    }
+
+private:
+    asio::io_service &io_service_;
+    BenchOptions options_;
+    asio::steady_timer timer_;
+    asio::steady_timer arrivalTimer_;
+
+    std::vector<std::unique_ptr<HttpClient>> workers_;
+
+    // Open-loop state: when each busy worker's request was due, idle workers and
+    // due requests still waiting for one.
+    std::vector<Clock::time_point> intended_;
+    std::vector<size_t> idle_;
+    std::deque<Clock::time_point> backlog_;
+    size_t maxBacklog_ = 0;
+    Clock::time_point nextArrival_;
+    std::mt19937_64 random_;
+    std::exponential_distribution<double> interarrival_;
+
+    bool measuring_ = false;
+    bool stopping_ = false;
+    Clock::time_point measureStart_;
+    Clock::time_point measureEnd_;
+
+    LatencyHistogram histogram_;
+    // Time spent in each phase of successful requests: lookup, connect,
+    // sending, waiting for the first byte and receiving the rest.
+    static const size_t kPhaseCount = 5;
+    std::array<LatencyHistogram, kPhaseCount> phases_;
+    uint64_t errors_ = 0;
+    std::map<std::string, uint64_t> errorCounts_;
+
+    void begin_measuring() {
+        measuring_ = true;
+        measureStart_ = Clock::now();
+
+        if (options_.requests == 0) {
+            timer_.expires_after(options_.duration);
+            timer_.async_wait([this](const boost::system::error_code &ec) {
+                if (!ec) {
+                    stop();
+                }
+            });
+        }
+    }
+
+    void stop() {
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+        measureEnd_ = Clock::now();
+        timer_.cancel();
+        arrivalTimer_.cancel();
+
+        // Requests still in flight would keep the run going for as long as
+        // they stall.
+        for (auto &worker : workers_) {
+            worker->Abort("Benchmark stopped");
+        }
+    }
+
+    Clock::duration next_interval() {
+        double seconds = options_.poisson ? interarrival_(random_) : 1.0 / options_.rate;
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    // Dispatches every request that has become due and sleeps until the next one.
+    void handle_arrivals() {
+        Clock::time_point now = Clock::now();
+
+        while (nextArrival_ <= now && !stopping_) {
+            if (idle_.empty()) {
+                backlog_.push_back(nextArrival_);
+                maxBacklog_ = std::max(maxBacklog_, backlog_.size());
+            } else {
+                size_t worker = idle_.back();
+                idle_.pop_back();
+                intended_[worker] = nextArrival_;
+                workers_[worker]->Start();
+            }
+            nextArrival_ += next_interval();
+        }
+
+        if (stopping_) {
+            return;
+        }
+
+        arrivalTimer_.expires_at(nextArrival_);
+        arrivalTimer_.async_wait([this](const boost::system::error_code &ec) {
+            if (!ec) {
+                handle_arrivals();
+            }
+        });
+    }
+
+    void record_phases(const HttpResult &result) {
+        const Clock::duration marks[kPhaseCount + 1] = {
+            Clock::duration::zero(), result.resolved, result.connected, result.sent, result.firstByte, result.elapsed,
+        };
+        for (size_t i = 0; i < kPhaseCount; ++i) {
+            Clock::duration phase = std::max(marks[i + 1] - marks[i], Clock::duration::zero());
+            phases_[i].Record(std::chrono::duration_cast<std::chrono::microseconds>(phase).count());
+        }
+    }
+
+    void handle_done(size_t worker) {
+        const HttpResult &result = workers_[worker]->Result();
+
+        if (measuring_ && !stopping_) {
+            if (result.error.empty()) {
+                Clock::duration latency = options_.rate > 0 ? Clock::now() - intended_[worker] : result.elapsed;
+                histogram_.Record(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+                record_phases(result);
+            } else {
+                ++errors_;
+                ++errorCounts_[result.error];
+            }
+
+            if (options_.requests != 0 && histogram_.Count() + errors_ >= options_.requests) {
+                stop();
+            }
+        }
+
+        if (stopping_) {
+            return;
+        }
+
+        if (options_.rate > 0) {
+            if (backlog_.empty()) {
+                idle_.push_back(worker);
+                return;
+            }
+            intended_[worker] = backlog_.front();
+            backlog_.pop_front();
+        }
+
+        // stop() may run before the posted start, and must not be followed
+        // by a request its abort sweep has missed.
+        io_service_.post([this, worker]() {
+            if (!stopping_) {
+                workers_[worker]->Start();
+            }
+        });
+    }
+};
+
+// Writes one byte range of a download at its offset in the output file. The
+// end may be pulled in while the range is being fetched; bytes past it are
+// dropped.
+class SegmentSink : public BodySink {
+public:
+    SegmentSink(int fd, uint64_t offset, uint64_t end) : fd_(fd), offset_(offset), end_(end) {}
+
+    bool Write(const char *data, size_t size) override {
+        size = static_cast<size_t>(std::min<uint64_t>(size, end_ - std::min(end_, offset_)));
+        while (size != 0) {
+            ssize_t written = ::pwrite(fd_, data, size, static_cast<off_t>(offset_));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= written;
+            offset_ += written;
+        }
+        return true;
+    }
+
+    int SpliceTo(int64_t &offset, uint64_t &limit) override {
+        offset = static_cast<int64_t>(offset_);
+        limit = end_ - std::min(end_, offset_);
+        return fd_;
+    }
+
+    void Spliced(size_t size) override {
+        offset_ += size;
+    }
+
+    uint64_t Offset() const {
+        return offset_;
+    }
+
+    uint64_t End() const {
+        return end_;
+    }
+
+    void SetEnd(uint64_t end) {
+        end_ = end;
+    }
+
+private:
+    int fd_;
+    uint64_t offset_;
+    uint64_t end_;
+};
+
+// Downloads one URL into a file over several connections. A HEAD probe finds
+// the size and whether byte ranges are supported; the file is preallocated
+// and split into one range per connection, each written in place with
+// pwrite. A connection that runs out of work takes the back half of the
+// largest range still in flight, so one slow connection does not hold up
+// the end of the download.
+class SegmentedDownload {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static const uint64_t kMinSteal = 256 * 1024;
+    static const int kMaxRetries = 3;
+
+    SegmentedDownload(asio::io_service &io_service, DnsCache &dns, ConnectionPool &pool,
+                      const Url &url, int fd, size_t segments)
+            : io_service_(io_service), dns_(dns), pool_(pool), url_(url), fd_(fd),
+              segments_(std::max<size_t>(segments, 1)) {}
+
+    // The probe and the range requests do their socket I/O through uring.
+    void UseUring(IoUring *uring) {
+        uring_ = uring;
+    }
+
+    // A range that times out is retried like any other failure.
+    void UseTimeouts(TimerWheel &wheel, const Timeouts &timeouts) {
+        wheel_ = &wheel;
+        timeouts_ = timeouts;
+    }
+
+    void Start() {
+        started_ = Clock::now();
+
+        probe_.reset(new HttpClient(
+                io_service_, dns_, pool_, url_.GetHost(), url_.GetPort(), url_.GetPath(), "", "HEAD"));
+        probe_->SetVerbose(false);
+        probe_->SetDecoding(false);
+        probe_->SetUring(uring_);
+        if (wheel_ != nullptr) {
+            probe_->SetTimeouts(*wheel_, timeouts_);
+        }
+        probe_->OnHeaders([this](const HttpResponseParser &parser) {
+            if (parser.StatusCode() != 200) {
+                return false;
+            }
+            if (parser.HasContentLength()) {
+                size_ = parser.ContentLength();
+                sizeKnown_ = true;
+            }
+            ranges_ = ascii_iequals(parser.Find(KnownHeader::AcceptRanges), "bytes");
+            return true;
+        });
+        probe_->OnDone([this]() {
+            io_service_.post([this]() { handle_probe(); });
+        });
+        probe_->Start();
+    }
+
+    bool Succeeded() const {
+        return error_.empty();
+    }
+
+    void Report() const {
+        if (!error_.empty()) {
+            fmt::print(stderr, "{}\n", error_);
+            return;
+        }
+
+        double seconds = std::chrono::duration<double>(Clock::now() - started_).count();
+        fmt::print(stderr, "{}: {} bytes in {:.2f} s over {} connections, {} ranges stolen, {} retries\n",
+                   url_.GetFullUrl(), written_, seconds, workers_.size(), steals_, retries_);
+    }
+
+private:
+    struct Worker {
+        std::unique_ptr<HttpClient> client;
+        std::unique_ptr<SegmentSink> sink;
+        uint64_t requestStart = 0;
+        bool busy = false;
+        int retries = 0;
+    };
+
+    asio::io_service &io_service_;
+    DnsCache &dns_;
+    ConnectionPool &pool_;
+    const Url url_;
+    const int fd_;
+    size_t segments_;
+    IoUring *uring_ = nullptr;
+    TimerWheel *wheel_ = nullptr;
+    Timeouts timeouts_;
+
+    std::unique_ptr<HttpClient> probe_;
+    uint64_t size_ = 0;
+    bool sizeKnown_ = false;
+    bool ranges_ = false;
+
+    std::vector<Worker> workers_;
+    // Ranges not assigned to any connection yet, as [begin, end).
+    std::deque<std::pair<uint64_t, uint64_t>> pending_;
+
+    Clock::time_point started_;
+    uint64_t written_ = 0;
+    size_t steals_ = 0;
+    size_t retries_ = 0;
+    std::string error_;
+
+    void handle_probe() {
+        const HttpResult &result = probe_->Result();
+        if (!result.error.empty()) {
+            error_ = fmt::format("Probing {} failed: {}", url_.GetFullUrl(), result.error);
+            return;
+        }
+
+        if (!sizeKnown_ || !ranges_ || size_ == 0) {
+            // Without a size or range support, or anything to split, the body
+            // is fetched in one piece.
+            segments_ = 1;
+            ranges_ = false;
+        }
+
+        uint64_t fileSize = sizeKnown_ ? size_ : 0;
+        if (fileSize != 0 && ::fallocate(fd_, 0, 0, static_cast<off_t>(fileSize)) != 0 &&
+            ::ftruncate(fd_, static_cast<off_t>(fileSize)) != 0) {
+            error_ = fmt::format("Cannot allocate {} bytes: {}", fileSize, std::strerror(errno));
+            return;
+        }
+
+        segments_ = static_cast<size_t>(std::min<uint64_t>(segments_, std::max<uint64_t>(fileSize / kMinSteal, 1)));
+        uint64_t step = fileSize / segments_;
+        for (size_t i = 0; i < segments_; ++i) {
+            uint64_t begin = i * step;
+            uint64_t end = i + 1 == segments_ ? (sizeKnown_ ? fileSize : UINT64_MAX) : begin + step;
+            pending_.emplace_back(begin, end);
+        }
+
+        workers_.resize(segments_);
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            Worker &worker = workers_[i];
+            worker.client.reset(new HttpClient(
+                    io_service_, dns_, pool_, url_.GetHost(), url_.GetPort(), url_.GetPath(), "", "GET"));
+            worker.client->SetVerbose(false);
+            // Ranges of a coded body could not be decoded apart.
+            worker.client->SetDecoding(false);
+            worker.client->SetUring(uring_);
+            if (wheel_ != nullptr) {
+                worker.client->SetTimeouts(*wheel_, timeouts_);
+            }
+            worker.client->OnHeaders(std::bind(&SegmentedDownload::check_headers, this, i, _1));
+            worker.client->OnDone([this, i]() {
+                io_service_.post([this, i]() { handle_done(i); });
+            });
+            assign_work(i);
+        }
+    }
+
+    bool check_headers(size_t index, const HttpResponseParser &parser) {
+        if (segments_ == 1 && !ranges_) {
+            return parser.StatusCode() == 200;
+        }
+
+        // Content-Range: bytes <first>-<last>/<size>
+        std::string expected = fmt::format("bytes {}-", workers_[index].requestStart);
+        return parser.StatusCode() == 206 && parser.Find(KnownHeader::ContentRange).starts_with(expected);
+    }
+
+    void start_range(size_t index, uint64_t begin, uint64_t end) {
+        Worker &worker = workers_[index];
+        worker.requestStart = begin;
+        worker.busy = true;
+        worker.sink.reset(new SegmentSink(fd_, begin, end));
+        worker.client->SetSink(worker.sink.get());
+
+        if (ranges_) {
+            worker.client->SetHeader("Range", fmt::format("bytes={}-{}", begin, end - 1));
+        }
+        worker.client->Start();
+    }
+
+    void assign_work(size_t index) {
+        if (!pending_.empty()) {
+            std::pair<uint64_t, uint64_t> range = pending_.front();
+            pending_.pop_front();
+            start_range(index, range.first, range.second);
+            return;
+        }
+
+        if (!ranges_) {
+            return;
+        }
+
+        // Steal the back half of the range with the most bytes left.
+        Worker *victim = nullptr;
+        for (auto &worker : workers_) {
+            if (worker.busy && (victim == nullptr || remaining(worker) > remaining(*victim))) {
+                victim = &worker;
+            }
+        }
+
+        if (victim == nullptr || remaining(*victim) < 2 * kMinSteal) {
+            return;
+        }
+
+        uint64_t end = victim->sink->End();
+        uint64_t middle = victim->sink->Offset() + remaining(*victim) / 2;
+        victim->sink->SetEnd(middle);
+        victim->client->LimitBody(middle - victim->requestStart);
+        ++steals_;
+
+        start_range(index, middle, end);
+    }
+
+    static uint64_t remaining(const Worker &worker) {
+        return worker.sink->End() - std::min(worker.sink->End(), worker.sink->Offset());
+    }
+
+    void handle_done(size_t index) {
+        Worker &worker = workers_[index];
+        const HttpResult &result = worker.client->Result();
+        worker.busy = false;
+        uint64_t received = worker.sink->Offset() - worker.requestStart;
+        written_ += received;
+
+        bool complete = result.error.empty() &&
+                        (worker.sink->Offset() >= worker.sink->End() || (!sizeKnown_ && segments_ == 1));
+        if (!complete) {
+            if (worker.retries++ == kMaxRetries) {
+                if (error_.empty()) {
+                    error_ = fmt::format("Range {}-{} of {} failed: {}", worker.sink->Offset(), worker.sink->End(),
+                                         url_.GetFullUrl(), result.error.empty() ? "short read" : result.error);
+                }
+                return;
+            }
+            ++retries_;
+            if (!ranges_) {
+                // The body can only be fetched again from its start.
+                written_ -= received;
+                if (!sizeKnown_ && ::ftruncate(fd_, 0) != 0) {
+                    error_ = fmt::format("Cannot truncate output: {}", std::strerror(errno));
+                    return;
+                }
+                start_range(index, worker.requestStart, worker.sink->End());
+                return;
+            }
+            start_range(index, worker.sink->Offset(), worker.sink->End());
+            return;
+        }
+
+        if (error_.empty()) {
+            assign_work(index);
+        }
+    }
+};
+
+// Everything needed to run requests on one thread: an io_service with its own
+// DNS cache and connection pool, so threads never share state.
+struct EventLoop {
+    asio::io_service io_service;
+    asio::ip::tcp::resolver resolver{io_service};
+    DnsCache dns;
+    ConnectionPool pool;
+    TimerWheel wheel{io_service};
+    // Set when HTTP/1.1 socket I/O goes through io_uring.
+    std::unique_ptr<IoUring> uring;
+
+    EventLoop(std::chrono::seconds dnsTtl, size_t maxIdle, size_t maxPerHost, std::chrono::seconds idleTimeout,
+              ConnectionPool::Balancing balancing, std::chrono::milliseconds attemptDelay)
+            : dns(resolver, dnsTtl, std::min(dnsTtl, std::chrono::seconds(5))),
+              pool(maxIdle, maxPerHost, idleTimeout, balancing) {
+        pool.SetAttemptDelay(attemptDelay);
+    }
+};
+
+// CPUs the calling thread may run on, in ascending order, as restricted by
+// taskset or a container's cpuset. Empty if the mask cannot be read.
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return cpus;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Pins the calling thread to a CPU. Returns 0 or an error number.
+int pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void docs(std::string programName) {
+    if (programName.empty()) {
+        programName = "mycurl";
+    }
+
+    fmt::print("Usage: {} [options...] <url>...\n"
+                " -d <data>   HTTP POST data\n"
+                " -m <method> HTTP method (default: GET)\n"
+                " -o <file>   Write response bodies to file instead of stdout\n"
+                "    --segments <n>      Download the URL to -o over n ranged connections\n"
+                "    --url-file <file>   Read URLs from file, one per line\n"
+                "    --parallel <n>      Requests in flight at once (default: 16)\n"
+                "    --pipeline <n>      Pipeline up to n GET/HEAD requests per connection, one\n"
+                "                        connection per host (default: 1)\n"
+                "    --http2             Use cleartext HTTP/2 with prior knowledge, multiplexing\n"
+                "                        all requests for a host on one connection\n"
+                "    --h2-window <bytes> HTTP/2 receive window per connection and stream\n"
+                "                        (default: 16777216)\n"
+                "    --discard           Count response bodies without writing them anywhere\n"
+                "                        (also implied by -o /dev/null)\n"
+                " -w, --write-out <fmt>  Print fmt to stdout after each request, expanding %{{http_code}},\n"
+                "                        %{{size_download}}, %{{time_namelookup}}, %{{time_connect}},\n"
+                "                        %{{time_pretransfer}}, %{{time_starttransfer}}, %{{time_total}},\n"
+                "                        %{{url}} and %{{errormsg}}\n"
+                "    --bench             Benchmark the first URL instead of printing it\n"
+                "    --io-uring          Do HTTP/1.1 socket I/O through io_uring, falling back to\n"
+                "                        asio where it is unavailable\n"
+                "    --threads <n>       Benchmark threads, each pinned to an allowed CPU with its\n"
+                "                        own connections (default: 1)\n"
+                " -c, --concurrency <n>  Concurrent benchmark connections (default: 10)\n"
+                "    --duration <s>      Measured benchmark time in seconds (default: 10)\n"
+                " -n, --requests <n>     Stop the benchmark after n measured requests\n"
+                "    --warmup <s>        Unmeasured seconds before the benchmark starts\n"
+                "    --rate <r>          Open-loop benchmark at r requests/sec, at most -c in flight\n"
+                "    --poisson           Poisson-distributed arrivals for --rate\n"
+                "    --dns-ttl <s>       Seconds a DNS result is reused (default: 60)\n"
+                "    --attempt-delay <ms> Delay before racing the next address (default: 250)\n"
+                "    --lb <rr|p2c>       Spread new connections over a name's addresses by round robin\n"
+                "                        or by the fewer requests in flight of two random ones (default: rr)\n"
+                "    --connect-timeout <s> Fail a request whose connection takes longer to set up\n"
+                "    --first-byte-timeout <s> Fail a request whose response takes longer to start\n"
+                "    --read-timeout <s>  Fail a request when the response stalls this long\n"
+                "    --max-time <s>      Fail a request that takes longer in total\n"
+                "    --max-idle <n>      Idle keep-alive connections to keep (default: 32)\n"
+                "    --max-per-host <n>  Idle keep-alive connections to keep per host (default: 8)\n"
+                "    --idle-timeout <s>  Seconds an idle connection is kept (default: 30)\n",
+                programName);
+}
+
+enum LongOption {
+    OPT_URL_FILE = 256,
+    OPT_PARALLEL,
+    OPT_DISCARD,
+    OPT_PIPELINE,
+    OPT_HTTP2,
+    OPT_H2_WINDOW,
+    OPT_SEGMENTS,
+    OPT_BENCH,
+    OPT_THREADS,
+    OPT_IO_URING,
+    OPT_DURATION,
+    OPT_WARMUP,
+    OPT_RATE,
+    OPT_POISSON,
+    OPT_DNS_TTL,
+    OPT_LB,
+    OPT_ATTEMPT_DELAY,
+    OPT_MAX_IDLE,
+    OPT_MAX_PER_HOST,
+    OPT_IDLE_TIMEOUT,
+    OPT_CONNECT_TIMEOUT,
+    OPT_FIRST_BYTE_TIMEOUT,
+    OPT_READ_TIMEOUT,
+    OPT_MAX_TIME,
+};
+
+std::chrono::steady_clock::duration parse_seconds(const char *text) {
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(std::strtod(text, nullptr)));
+}
+
+int main(int argc, char *argv[]) {
+    std::string method = "GET";
+    std::string body;
+    std::string output;
+    std::string writeOut;
+    bool discard = false;
+
+    size_t maxIdle = 32;
+    size_t maxPerHost = 8;
+    long idleTimeout = 30;
+    long dnsTtl = 60;
+    ConnectionPool::Balancing balancing = ConnectionPool::RoundRobin;
+    long attemptDelay = 250;
+    size_t parallel = 16;
+    size_t pipeline = 1;
+    bool http2 = false;
+    uint32_t h2Window = Http2Connection::kDefaultWindow;
+    size_t segments = 0;
+    std::vector<std::string> urls;
+
+    bool bench = false;
+    size_t threads = 1;
+    bool threadsSet = false;
+    bool ioUring = false;
+    Timeouts timeouts;
+    BenchOptions benchOptions;
+
+    static const option longOptions[] = {
+        {"url-file", required_argument, nullptr, OPT_URL_FILE},
+        {"parallel", required_argument, nullptr, OPT_PARALLEL},
+        {"write-out", required_argument, nullptr, 'w'},
+        {"discard", no_argument, nullptr, OPT_DISCARD},
+        {"pipeline", required_argument, nullptr, OPT_PIPELINE},
+        {"http2", no_argument, nullptr, OPT_HTTP2},
+        {"h2-window", required_argument, nullptr, OPT_H2_WINDOW},
+        {"segments", required_argument, nullptr, OPT_SEGMENTS},
+        {"bench", no_argument, nullptr, OPT_BENCH},
+        {"threads", required_argument, nullptr, OPT_THREADS},
+        {"io-uring", no_argument, nullptr, OPT_IO_URING},
+        {"concurrency", required_argument, nullptr, 'c'},
+        {"duration", required_argument, nullptr, OPT_DURATION},
+        {"requests", required_argument, nullptr, 'n'},
+        {"warmup", required_argument, nullptr, OPT_WARMUP},
+        {"rate", required_argument, nullptr, OPT_RATE},
+        {"poisson", no_argument, nullptr, OPT_POISSON},
+        {"dns-ttl", required_argument, nullptr, OPT_DNS_TTL},
+        {"lb", required_argument, nullptr, OPT_LB},
+        {"attempt-delay", required_argument, nullptr, OPT_ATTEMPT_DELAY},
+        {"max-idle", required_argument, nullptr, OPT_MAX_IDLE},
+        {"max-per-host", required_argument, nullptr, OPT_MAX_PER_HOST},
+        {"idle-timeout", required_argument, nullptr, OPT_IDLE_TIMEOUT},
+        {"connect-timeout", required_argument, nullptr, OPT_CONNECT_TIMEOUT},
+        {"first-byte-timeout", required_argument, nullptr, OPT_FIRST_BYTE_TIMEOUT},
+        {"read-timeout", required_argument, nullptr, OPT_READ_TIMEOUT},
+        {"max-time", required_argument, nullptr, OPT_MAX_TIME},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    if (argc < 2) {
+        docs(argv[0]);
+        return 0;
+    }
+
+    int c;
+    while ((c = getopt_long(argc, argv, "m:d:o:c:n:w:", longOptions, nullptr)) != -1) {
+        switch (c) {
+            case 'm':
+                method = optarg;
+                boost::to_upper(method);
+                break;
+            case 'd':
+                body = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'w':
+                writeOut = optarg;
+                break;
+            case OPT_DISCARD:
+                discard = true;
+                break;
+            case OPT_URL_FILE: {
+                std::ifstream file(optarg);
+                if (!file) {
+                    fmt::print(stderr, "Cannot open URL file {}\n", optarg);
+                    return 1;
+                }
+                std::string line;
+                while (std::getline(file, line)) {
+                    boost::trim(line);
+                    if (!line.empty() && line[0] != '#') {
+                        urls.push_back(line);
+                    }
+                }
+                break;
+            }
+            case OPT_PARALLEL:
+                parallel = std::strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_PIPELINE:
+                pipeline = std::strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_HTTP2:
+                http2 = true;
+                break;
+            case OPT_H2_WINDOW:
+                h2Window = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10));
+                break;
+            case OPT_SEGMENTS:
+                segments = std::strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_BENCH:
+                bench = true;
+                break;
+            case OPT_THREADS:
+                threads = std::max<size_t>(std::strtoul(optarg, nullptr, 10), 1);
+                threadsSet = true;
+                break;
+            case OPT_IO_URING:
+                ioUring = true;
+                break;
+            case 'c':
+                benchOptions.concurrency = std::strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_DURATION:
+                benchOptions.duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(std::strtod(optarg, nullptr)));
+                break;
+            case 'n':
+                benchOptions.requests = std::strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_WARMUP:
+                benchOptions.warmup = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(std::strtod(optarg, nullptr)));
+                break;
+            case OPT_RATE:
+                benchOptions.rate = std::strtod(optarg, nullptr);
+                break;
+            case OPT_POISSON:
+                benchOptions.poisson = true;
+                break;
+            case OPT_DNS_TTL:
+                dnsTtl = std::strtol(optarg, nullptr, 10);
+                break;
+            case OPT_LB:
+                if (std::strcmp(optarg, "p2c") == 0) {
+                    balancing = ConnectionPool::TwoChoices;
+                } else if (std::strcmp(optarg, "rr") == 0) {
+                    balancing = ConnectionPool::RoundRobin;
+                } else {
+                    docs(argv[0]);
+                    return 0;
+                }
+                break;
+            case OPT_ATTEMPT_DELAY:
+                attemptDelay = std::strtol(optarg, nullptr, 10);
+                break;
+            case OPT_MAX_IDLE:
+                maxIdle = std::strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_MAX_PER_HOST:
+                maxPerHost = std::strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_IDLE_TIMEOUT:
+                idleTimeout = std::strtol(optarg, nullptr, 10);
+                break;
+            case OPT_CONNECT_TIMEOUT:
+                timeouts.connect = parse_seconds(optarg);
+                break;
+            case OPT_FIRST_BYTE_TIMEOUT:
+                timeouts.firstByte = parse_seconds(optarg);
+                break;
+            case OPT_READ_TIMEOUT:
+                timeouts.idle = parse_seconds(optarg);
+                break;
+            case OPT_MAX_TIME:
+                timeouts.total = parse_seconds(optarg);
+                break;
+            default:
+                docs(argv[0]);
+                return 0;
+        }
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        urls.push_back(argv[i]);
+    }
+
+    if (urls.empty()) {
+        docs(argv[0]);
+        return 0;
+    }
+
+    // There is no TLS, so any other scheme would be spoken to in cleartext.
+    for (const auto &url : urls) {
+        std::string protocol = Url(url).GetProtocol();
+        if (protocol != "http") {
+            fmt::print(stderr, "Unsupported protocol \"{}\" in {}: only http:// URLs are supported\n", protocol, url);
+            return 1;
+        }
+    }
+
+    if (bench) {
+        // Every benchmark connection goes back to the pool between requests.
+        maxIdle = std::max(maxIdle, benchOptions.concurrency);
+        maxPerHost = std::max(maxPerHost, benchOptions.concurrency);
+    }
+
+    if (threadsSet && !bench) {
+        fmt::print(stderr, "--threads only applies to --bench\n");
+        return 1;
+    }
+
+    if (pipeline > 1 && (bench || segments != 0)) {
+        fmt::print(stderr, "--pipeline does not apply to --bench or --segments\n");
+        return 1;
+    }
+
+    if (http2 && (bench || segments != 0)) {
+        fmt::print(stderr, "--http2 does not apply to --bench or --segments\n");
+        return 1;
+    }
+
+    if (segments != 0) {
+        if (output.empty()) {
+            fmt::print(stderr, "--segments needs an output file (-o)\n");
+            return 1;
+        }
+        maxIdle = std::max(maxIdle, segments);
+        maxPerHost = std::max(maxPerHost, segments);
+    }
+
+    auto makeLoop = [&]() {
+        std::unique_ptr<EventLoop> loop(new EventLoop(
+                std::chrono::seconds(dnsTtl), maxIdle, maxPerHost, std::chrono::seconds(idleTimeout),
+                balancing, std::chrono::milliseconds(attemptDelay)));
+        if (ioUring) {
+            std::string error;
+            size_t connections = bench ? benchOptions.concurrency : std::max(parallel, segments);
+            loop->uring = IoUring::Create(loop->io_service, 256, connections, error);
+            if (!loop->uring) {
+                fmt::print(stderr, "io_uring unavailable ({}), using asio\n", error);
+                ioUring = false;
+            }
+        }
+        return loop;
+    };
+
+    if (bench) {
+        // Every shard needs at least one connection and one request.
+        threads = std::min(threads, std::max<size_t>(benchOptions.concurrency, 1));
+        if (benchOptions.requests != 0) {
+            threads = std::min(threads, benchOptions.requests);
+        }
+
+        std::vector<std::unique_ptr<EventLoop>> loops;
+        std::vector<std::unique_ptr<BenchRunner>> runners;
+        for (size_t i = 0; i < threads; ++i) {
+            loops.push_back(makeLoop());
+            runners.emplace_back(new BenchRunner(loops[i]->io_service, loops[i]->dns, loops[i]->pool,
+                                                 Url(urls.front()), method, body,
+                                                 benchOptions.Share(i, threads)));
+            runners[i]->UseUring(loops[i]->uring.get());
+            runners[i]->UseTimeouts(loops[i]->wheel, timeouts);
+        }
+
+        // Workers go round the CPUs the process is allowed on, not core
+        // numbers that may lie outside its cpuset.
+        std::vector<int> cpus = allowed_cpus();
+        if (cpus.empty()) {
+            fmt::print(stderr, "Cannot read the CPU affinity mask ({}), benchmark threads are not pinned\n",
+                       std::strerror(errno));
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([&loops, &runners, &cpus, i]() {
+                if (!cpus.empty()) {
+                    int cpu = cpus[i % cpus.size()];
+                    int error = pin_to_cpu(cpu);
+                    if (error != 0) {
+                        LOG_WARN("Cannot pin benchmark thread {} to CPU {}: {}\n", i, cpu, std::strerror(error));
+                    }
+                }
+                runners[i]->Start();
+                loops[i]->io_service.run();
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        for (size_t i = 1; i < threads; ++i) {
+            runners[0]->Merge(*runners[i]);
+        }
+        LOG_FLUSH();
+        runners[0]->Report();
+        return 0;
+    }
+
+    std::unique_ptr<EventLoop> loop = makeLoop();
+    asio::io_service &io_service = loop->io_service;
+    DnsCache &dns = loop->dns;
+    ConnectionPool &pool = loop->pool;
+
+    if (segments != 0) {
+        int fd = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fmt::print(stderr, "Cannot open output file {}: {}\n", output, std::strerror(errno));
+            return 1;
+        }
+
+        SegmentedDownload download(io_service, dns, pool, Url(urls.front()), fd, segments);
+        download.UseUring(loop->uring.get());
+        download.UseTimeouts(loop->wheel, timeouts);
+        download.Start();
+        io_service.run();
+        ::close(fd);
+        LOG_FLUSH();
+        download.Report();
+        return download.Succeeded() ? 0 : 1;
+    }
+
+    // Health checks only need the status and size, so bodies are not even
+    // copied out of the receive buffers.
+    if (output == "/dev/null") {
+        discard = true;
+    }
+
+    std::unique_ptr<FILE, int (*)(FILE *)> outputFile(nullptr, &std::fclose);
+    if (!output.empty() && !discard) {
+        outputFile.reset(std::fopen(output.c_str(), "wb"));
+        if (!outputFile) {
+            fmt::print(stderr, "Cannot open output file {}: {}\n", output, std::strerror(errno));
+            return 1;
+        }
+    }
+    FileSink sink(outputFile ? outputFile.get() : stdout);
+
+    FetchScheduler scheduler(io_service, dns, pool, discard ? nullptr : &sink, method, body, parallel, pipeline);
+    scheduler.UseUring(loop->uring.get());
+    scheduler.UseTimeouts(loop->wheel, timeouts);
+    if (http2) {
+        scheduler.UseHttp2(h2Window);
+    }
+    scheduler.SetWriteOut(writeOut);
+    for (auto &url : urls) {
+        scheduler.Add(std::move(url));
+    }
+    scheduler.Start();
+
+    io_service.run();
+
+    LOG_FLUSH();
+    if (urls.size() > 1) {
+        fmt::print(stderr, "{} succeeded, {} failed\n", scheduler.Succeeded(), scheduler.Failed());
+    }
 
-    return 0;
+    return scheduler.Failed() == 0 ? 0 : 1;
 }
\ No newline at end of file